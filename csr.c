@@ -0,0 +1,47 @@
+/*
+ * csr.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "csr.h"
+
+
+/* Allocate a CSR matrix able to hold nb_rows points with nnz non-zeros in total. Returns NULL if an allocation failed. */
+CsrMatrix* init_csr(int nb_rows, int nnz, int has_classes) {
+    CsrMatrix *csr = malloc(sizeof(CsrMatrix));
+
+    if (csr == NULL) {
+        printf("Error while allocating in csr initialization\n");
+        return NULL;
+    }
+
+    csr->nb_rows = nb_rows;
+    csr->nnz = nnz;
+    csr->row_ptr = malloc(sizeof(int) * (nb_rows + 1));
+    csr->indices = malloc(sizeof(int) * (nnz > 0 ? nnz : 1));
+    csr->values = malloc(sizeof(float) * (nnz > 0 ? nnz : 1));
+    csr->classes = has_classes ? malloc(sizeof(float) * (nb_rows > 0 ? nb_rows : 1)) : NULL;
+
+    if (csr->row_ptr == NULL || csr->indices == NULL || csr->values == NULL || (has_classes && csr->classes == NULL)) {
+        printf("Error while allocating in csr initialization\n");
+        delete_csr(csr);
+        return NULL;
+    }
+
+    *csr->row_ptr = 0;
+    return csr;
+}
+
+
+/* Deallocate matrix and its arrays */
+void delete_csr(CsrMatrix* csr) {
+    if (csr != NULL) {
+        free(csr->row_ptr);
+        free(csr->indices);
+        free(csr->values);
+        free(csr->classes);
+        free(csr);
+    }
+}
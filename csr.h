@@ -0,0 +1,21 @@
+/*
+ * csr.h
+ */
+
+#ifndef PROJECT_CSR_H_
+#define PROJECT_CSR_H_
+
+/* Sparse points stored in compressed sparse row format: non-zeros of point i are indices/values between row_ptr[i] and
+ * row_ptr[i + 1]. Indices are 0-based. classes is only allocated for environment points. */
+
+typedef struct {
+    int nb_rows, nnz;
+    int *row_ptr, *indices;
+    float *values, *classes;
+} CsrMatrix;
+
+CsrMatrix* init_csr(int nb_rows, int nnz, int has_classes);
+
+void delete_csr(CsrMatrix* csr);
+
+#endif /* PROJECT_CSR_H_ */
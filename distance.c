@@ -0,0 +1,313 @@
+/*
+ * distance.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "distance.h"
+#include "heap.h"
+#include "csr.h"
+
+
+/*
+ * Per-metric building blocks. ACC folds one coordinate pair into the accumulator, FIN turns the accumulator into the final distance.
+ * They are pasted into the scan kernels below so each metric gets its own loop that the compiler can inline and vectorize.
+ * */
+#define L2_ACC(acc, e, c)         { double d = (float) ((e) - (c)); acc += d * d; }
+#define L2_FIN(acc)               sqrt(acc)
+
+#define L1_ACC(acc, e, c)         { acc += fabs((double) ((e) - (c))); }
+#define L1_FIN(acc)               (acc)
+
+#define CHEBYSHEV_ACC(acc, e, c)  { double d = fabs((double) ((e) - (c))); if (d > acc) acc = d; }
+#define CHEBYSHEV_FIN(acc)        (acc)
+
+#define MINKOWSKI_ACC(acc, e, c)  { acc += pow(fabs((double) ((e) - (c))), p); }
+#define MINKOWSKI_FIN(acc)        pow(acc, 1.0 / p)
+
+// Cosine accumulates the dot product, norms are computed once beforehand
+#define COSINE_ACC(acc, e, c)     { acc += (double) (e) * (c); }
+#define COSINE_FIN(acc)           (env_norm == 0 || chall_norm == 0 ? 1.0 : 1.0 - (acc) / (env_norm * chall_norm))
+
+
+/* Only call heap_insert when the candidate can beat the current k-th point (root), which is the common case to skip. Distances are
+ * rounded to single precision as sent to the master, so that slaves select their closest points on the keys the master merges. */
+#define PUSH_CANDIDATE(dist, class, heap) \
+    { \
+        double rounded = (float) (dist); \
+        if (rounded <= (heap)->nodesArray->distance) \
+            heap_insert(rounded, class, heap); \
+    }
+
+
+/* Generic kernel, the dimension is only known at runtime. */
+#define DEFINE_SCAN_KERNEL(NAME, ACC, FIN) \
+static void scan_##NAME(float* environment, int env_size, float* env_norms, float* challenger, double chall_norm, int dimension, \
+                        double p, Heap* heap) { \
+    (void) env_norms; (void) chall_norm; (void) p; \
+    double acc, env_norm = 0; \
+    float *point; \
+    for (int cur_env = 0 ; cur_env < env_size ; cur_env++) { \
+        point = environment + cur_env * (dimension + 1); \
+        if (env_norms != NULL) \
+            env_norm = *(env_norms + cur_env); \
+        acc = 0; \
+        for (int i = 0 ; i < dimension ; i++) \
+            ACC(acc, *(point + i + 1), *(challenger + i)) \
+        (void) env_norm; \
+        PUSH_CANDIDATE(FIN(acc), *point, heap) \
+    } \
+}
+
+/* Full unrolling of a loop of n iterations, -O2 alone leaves the coordinate loop rolled */
+#define PRAGMA(x) _Pragma(#x)
+#define UNROLL(n) PRAGMA(GCC unroll n)
+
+/* Kernel for a dimension fixed at compile time: the challenger is copied in a local array the compiler keeps in registers and the
+ * coordinate loop is fully unrolled, environment points are streamed through. */
+#define DEFINE_FIXED_SCAN_KERNEL(NAME, ACC, FIN, DIM) \
+static void scan_##NAME##_##DIM(float* environment, int env_size, float* env_norms, float* challenger, double chall_norm, \
+                                int dimension, double p, Heap* heap) { \
+    (void) env_norms; (void) chall_norm; (void) p; (void) dimension; \
+    float chall[DIM]; \
+    UNROLL(DIM) \
+    for (int i = 0 ; i < DIM ; i++) \
+        chall[i] = *(challenger + i); \
+    double acc, env_norm = 0; \
+    float *point; \
+    for (int cur_env = 0 ; cur_env < env_size ; cur_env++) { \
+        point = environment + cur_env * (DIM + 1); \
+        if (env_norms != NULL) \
+            env_norm = *(env_norms + cur_env); \
+        acc = 0; \
+        UNROLL(DIM) \
+        for (int i = 0 ; i < DIM ; i++) \
+            ACC(acc, *(point + i + 1), chall[i]) \
+        (void) env_norm; \
+        PUSH_CANDIDATE(FIN(acc), *point, heap) \
+    } \
+}
+
+/* Dimensions that get their own kernel, keep in sync with KERNEL_ROW */
+static const int fixed_dimensions[] = {2, 3, 4, 8, 16};
+#define NB_FIXED_DIMENSIONS ((int) (sizeof(fixed_dimensions) / sizeof(*fixed_dimensions)))
+
+#define DEFINE_METRIC_KERNELS(NAME, ACC, FIN) \
+    DEFINE_SCAN_KERNEL(NAME, ACC, FIN) \
+    DEFINE_FIXED_SCAN_KERNEL(NAME, ACC, FIN, 2) \
+    DEFINE_FIXED_SCAN_KERNEL(NAME, ACC, FIN, 3) \
+    DEFINE_FIXED_SCAN_KERNEL(NAME, ACC, FIN, 4) \
+    DEFINE_FIXED_SCAN_KERNEL(NAME, ACC, FIN, 8) \
+    DEFINE_FIXED_SCAN_KERNEL(NAME, ACC, FIN, 16)
+
+#define KERNEL_ROW(NAME) {scan_##NAME##_2, scan_##NAME##_3, scan_##NAME##_4, scan_##NAME##_8, scan_##NAME##_16, scan_##NAME}
+
+DEFINE_METRIC_KERNELS(l2, L2_ACC, L2_FIN)
+DEFINE_METRIC_KERNELS(l1, L1_ACC, L1_FIN)
+DEFINE_METRIC_KERNELS(cosine, COSINE_ACC, COSINE_FIN)
+DEFINE_METRIC_KERNELS(chebyshev, CHEBYSHEV_ACC, CHEBYSHEV_FIN)
+DEFINE_METRIC_KERNELS(minkowski, MINKOWSKI_ACC, MINKOWSKI_FIN)
+
+
+/* Radius kernel: count (and store if found is not NULL) the environment points within radius of the challenger. */
+#define DEFINE_RADIUS_KERNEL(NAME, ACC, FIN) \
+static int radius_##NAME(float* environment, int env_size, float* env_norms, float* challenger, double chall_norm, int dimension, \
+                         double p, double radius, Candidate* found) { \
+    (void) env_norms; (void) chall_norm; (void) p; \
+    double acc, dist, env_norm = 0; \
+    float *point; \
+    int nb_found = 0; \
+    for (int cur_env = 0 ; cur_env < env_size ; cur_env++) { \
+        point = environment + cur_env * (dimension + 1); \
+        if (env_norms != NULL) \
+            env_norm = *(env_norms + cur_env); \
+        acc = 0; \
+        for (int i = 0 ; i < dimension ; i++) \
+            ACC(acc, *(point + i + 1), *(challenger + i)) \
+        (void) env_norm; \
+        dist = FIN(acc); \
+        if (dist <= radius) { \
+            if (found != NULL) { \
+                (found + nb_found)->distance = dist; \
+                (found + nb_found)->class = (int) *point; \
+            } \
+            nb_found++; \
+        } \
+    } \
+    return nb_found; \
+}
+
+DEFINE_RADIUS_KERNEL(l2, L2_ACC, L2_FIN)
+DEFINE_RADIUS_KERNEL(l1, L1_ACC, L1_FIN)
+DEFINE_RADIUS_KERNEL(cosine, COSINE_ACC, COSINE_FIN)
+DEFINE_RADIUS_KERNEL(chebyshev, CHEBYSHEV_ACC, CHEBYSHEV_FIN)
+DEFINE_RADIUS_KERNEL(minkowski, MINKOWSKI_ACC, MINKOWSKI_FIN)
+
+
+/*
+ * Sparse kernels. Distances are expressed with precomputed norms (sum of |x|^q, q depending on the metric) and a correction
+ * accumulated over the overlapping non-zeros only: |a - b|^q = |a|^q + |b|^q - (|a|^q + |b|^q - |a - b|^q), the
+ * parenthesis being null when a or b is 0. OVERLAP folds one overlapping pair, SPARSE_FIN builds the distance.
+ * Chebyshev cannot be decomposed this way and has no sparse kernel.
+ * */
+#define L2_OVERLAP(acc, a, b)         { acc += (double) (a) * (b); }
+#define L2_SPARSE_FIN(acc)            sqrt(MAX_ZERO(env_norm + chall_norm - 2 * (acc)))
+
+#define L1_OVERLAP(acc, a, b)         { acc += fabs((double) (a)) + fabs((double) (b)) - fabs((double) (a) - (b)); }
+#define L1_SPARSE_FIN(acc)            MAX_ZERO(env_norm + chall_norm - (acc))
+
+#define MINKOWSKI_OVERLAP(acc, a, b)  { if ((b) != 0) acc += pow(fabs((double) (a)), p) + pow(fabs((double) (b)), p) - pow(fabs((double) (a) - (b)), p); }
+#define MINKOWSKI_SPARSE_FIN(acc)     pow(MAX_ZERO(env_norm + chall_norm - (acc)), 1.0 / p)
+
+#define COSINE_OVERLAP(acc, a, b)     L2_OVERLAP(acc, a, b)
+#define COSINE_SPARSE_FIN(acc)        (env_norm == 0 || chall_norm == 0 ? 1.0 : 1.0 - (acc) / sqrt(env_norm * chall_norm))
+
+// Rounding may bring norm differences slightly below 0
+#define MAX_ZERO(X) ((X) > 0 ? (X) : 0)
+
+
+/* Sparse-dense kernel: the challenger has been scattered in a dense array, each environment non-zero is looked up directly. */
+#define DEFINE_SPARSE_DENSE_SCAN_KERNEL(NAME, OVERLAP, FIN) \
+static void scan_sparse_dense_##NAME(CsrMatrix* environment, double* env_norms, int* chall_indices, float* chall_values, \
+                                     int chall_nnz, float* dense_chall, double chall_norm, double p, Heap* heap) { \
+    (void) chall_indices; (void) chall_values; (void) chall_nnz; (void) p; \
+    double acc, env_norm; \
+    for (int cur_env = 0 ; cur_env < environment->nb_rows ; cur_env++) { \
+        env_norm = *(env_norms + cur_env); \
+        acc = 0; \
+        for (int e = *(environment->row_ptr + cur_env) ; e < *(environment->row_ptr + cur_env + 1) ; e++) \
+            OVERLAP(acc, *(environment->values + e), *(dense_chall + *(environment->indices + e))) \
+        PUSH_CANDIDATE(FIN(acc), *(environment->classes + cur_env), heap) \
+    } \
+}
+
+/* Sparse-sparse kernel: both index lists are sorted, walk them together and only stop on common indices. */
+#define DEFINE_SPARSE_SCAN_KERNEL(NAME, OVERLAP, FIN) \
+static void scan_sparse_##NAME(CsrMatrix* environment, double* env_norms, int* chall_indices, float* chall_values, \
+                               int chall_nnz, float* dense_chall, double chall_norm, double p, Heap* heap) { \
+    (void) dense_chall; (void) p; \
+    double acc, env_norm; \
+    int e, e_end, c; \
+    for (int cur_env = 0 ; cur_env < environment->nb_rows ; cur_env++) { \
+        env_norm = *(env_norms + cur_env); \
+        acc = 0; \
+        e = *(environment->row_ptr + cur_env); \
+        e_end = *(environment->row_ptr + cur_env + 1); \
+        c = 0; \
+        while (e < e_end && c < chall_nnz) { \
+            if (*(environment->indices + e) < *(chall_indices + c)) { \
+                e++; \
+            } else if (*(environment->indices + e) > *(chall_indices + c)) { \
+                c++; \
+            } else { \
+                OVERLAP(acc, *(environment->values + e), *(chall_values + c)) \
+                e++; \
+                c++; \
+            } \
+        } \
+        PUSH_CANDIDATE(FIN(acc), *(environment->classes + cur_env), heap) \
+    } \
+}
+
+#define DEFINE_SPARSE_METRIC_KERNELS(NAME, OVERLAP, FIN) \
+    DEFINE_SPARSE_DENSE_SCAN_KERNEL(NAME, OVERLAP, FIN) \
+    DEFINE_SPARSE_SCAN_KERNEL(NAME, OVERLAP, FIN)
+
+DEFINE_SPARSE_METRIC_KERNELS(l2, L2_OVERLAP, L2_SPARSE_FIN)
+DEFINE_SPARSE_METRIC_KERNELS(l1, L1_OVERLAP, L1_SPARSE_FIN)
+DEFINE_SPARSE_METRIC_KERNELS(cosine, COSINE_OVERLAP, COSINE_SPARSE_FIN)
+DEFINE_SPARSE_METRIC_KERNELS(minkowski, MINKOWSKI_OVERLAP, MINKOWSKI_SPARSE_FIN)
+
+
+/*
+ * Translate command line metric name (and order for Minkowski) into a Metric. Returns -1 if the name is unknown or
+ * the order is invalid.
+ * */
+int parse_metric(Metric* metric, char name[], char order[]) {
+    static const char *names[NB_METRICS] = {"l2", "l1", "cosine", "chebyshev", "minkowski"};
+
+    metric->type = -1;
+    metric->p = 2;
+    for (int i = 0 ; i < NB_METRICS ; i++) {
+        if (!strcmp(name, names[i]))
+            metric->type = i;
+    }
+
+    if (metric->type == METRIC_MINKOWSKI && order != NULL) {
+        char *endPtr;
+        metric->p = strtod(order, &endPtr);
+        if (*endPtr != '\0' || metric->p <= 0)
+            return -1;
+    }
+
+    return metric->type == -1 ? -1 : 0;
+}
+
+
+/* Pick the scan kernel once, before the computation loop: unrolled kernel if the dimension has one, generic one otherwise. */
+scan_kernel select_kernel(Metric metric, int dimension) {
+    static const scan_kernel kernels[NB_METRICS][NB_FIXED_DIMENSIONS + 1] = {
+        KERNEL_ROW(l2), KERNEL_ROW(l1), KERNEL_ROW(cosine), KERNEL_ROW(chebyshev), KERNEL_ROW(minkowski)
+    };
+
+    int dim_index = 0;
+    while (dim_index < NB_FIXED_DIMENSIONS && fixed_dimensions[dim_index] != dimension)
+        dim_index++;
+
+    return kernels[metric.type][dim_index];
+}
+
+
+/* Euclidean norm of nb_points points whose coordinates start every stride floats (stride > dimension when a class precedes them). */
+void compute_norms(float* norms, float* points, int nb_points, int stride, int dimension) {
+    double acc;
+    for (int i = 0 ; i < nb_points ; i++) {
+        acc = 0;
+        for (int c = 0 ; c < dimension ; c++)
+            acc += (double) *(points + i * stride + c) * *(points + i * stride + c);
+        *(norms + i) = sqrt(acc);
+    }
+}
+
+
+/* Pick the radius kernel once. */
+radius_kernel select_radius_kernel(Metric metric) {
+    static const radius_kernel kernels[NB_METRICS] = {radius_l2, radius_l1, radius_cosine, radius_chebyshev, radius_minkowski};
+
+    return kernels[metric.type];
+}
+
+
+/* Pick the sparse kernel once. Returns NULL if the metric has no sparse kernel. */
+sparse_scan_kernel select_sparse_kernel(Metric metric, int dense_challenger) {
+    static const sparse_scan_kernel kernels[NB_METRICS][2] = {
+        {scan_sparse_l2, scan_sparse_dense_l2},
+        {scan_sparse_l1, scan_sparse_dense_l1},
+        {scan_sparse_cosine, scan_sparse_dense_cosine},
+        {NULL, NULL},
+        {scan_sparse_minkowski, scan_sparse_dense_minkowski}
+    };
+
+    return kernels[metric.type][dense_challenger ? 1 : 0];
+}
+
+
+/* Norms used by the sparse kernels: sum of |x|^q for each point, q being 1 for l1, p for minkowski and 2 otherwise. */
+void compute_sparse_norms(double* norms, CsrMatrix* points, Metric metric) {
+    double acc, value;
+    for (int i = 0 ; i < points->nb_rows ; i++) {
+        acc = 0;
+        for (int c = *(points->row_ptr + i) ; c < *(points->row_ptr + i + 1) ; c++) {
+            value = fabs((double) *(points->values + c));
+            if (metric.type == METRIC_L1)
+                acc += value;
+            else if (metric.type == METRIC_MINKOWSKI)
+                acc += pow(value, metric.p);
+            else
+                acc += value * value;
+        }
+        *(norms + i) = acc;
+    }
+}
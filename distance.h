@@ -0,0 +1,52 @@
+/*
+ * distance.h
+ */
+
+#ifndef PROJECT_DISTANCE_H_
+#define PROJECT_DISTANCE_H_
+
+#include "heap.h"
+#include "csr.h"
+
+/* Above this dimension challengers are not scattered in a dense array, sparse kernels walk both index lists instead */
+#define SPARSE_DENSE_MAX_DIMENSION (1 << 22)
+
+/* Supported metrics. The selection is made once per run, each metric has its own specialized scan kernel so that the inner loop
+ * never branches on the metric. */
+
+enum {
+    METRIC_L2, METRIC_L1, METRIC_COSINE, METRIC_CHEBYSHEV, METRIC_MINKOWSKI, NB_METRICS
+};
+
+typedef struct {
+    int type;
+    double p;  // order of the Minkowski metric (ignored by others)
+} Metric;
+
+/* Compare one challenger to env_size environment points (stored as "class coord1 coord2 ...") and keep the closest ones in the heap.
+ * env_norms and chall_norm are only used by the cosine metric (NULL/0 otherwise). */
+typedef void (*scan_kernel)(float* environment, int env_size, float* env_norms, float* challenger, double chall_norm, int dimension,
+                            double p, Heap* heap);
+
+/* Same for sparse points. dense_chall holds the challenger scattered in a dense array (NULL for the sparse-sparse kernel),
+ * norms are the ones given by compute_sparse_norms. */
+typedef void (*sparse_scan_kernel)(CsrMatrix* environment, double* env_norms, int* chall_indices, float* chall_values,
+                                   int chall_nnz, float* dense_chall, double chall_norm, double p, Heap* heap);
+
+/* Radius query: count environment points within radius of the challenger, and store them in found if it is not NULL. */
+typedef int (*radius_kernel)(float* environment, int env_size, float* env_norms, float* challenger, double chall_norm, int dimension,
+                             double p, double radius, Candidate* found);
+
+int parse_metric(Metric* metric, char name[], char order[]);
+
+scan_kernel select_kernel(Metric metric, int dimension);
+
+void compute_norms(float* norms, float* points, int nb_points, int stride, int dimension);
+
+radius_kernel select_radius_kernel(Metric metric);
+
+sparse_scan_kernel select_sparse_kernel(Metric metric, int dense_challenger);
+
+void compute_sparse_norms(double* norms, CsrMatrix* points, Metric metric);
+
+#endif /* PROJECT_DISTANCE_H_ */
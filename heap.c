@@ -18,7 +18,7 @@
  * distance which will simplify other functions implementation. */
 Heap* init_heap(unsigned capacity) {
     HeapNode *heapArray = malloc(sizeof(HeapNode) * capacity);
-    Heap* heap = malloc(sizeof(heap));
+    Heap* heap = malloc(sizeof(Heap));
 
     if (heapArray == NULL || heap == NULL) {
         printf("Error while allocating in heap initialization\n");
@@ -50,12 +50,11 @@ void clear_heap(Heap *heap) {
 }
 
 
-/* Deallocate nodes */
+/* Deallocate nodes and heap */
 void delete_heap(Heap* heap) {
     if (heap != NULL) {
         free(heap->nodesArray);
-        heap->nodesArray = NULL;
-        heap = NULL;
+        free(heap);
     }
 }
 
@@ -81,7 +80,16 @@ Heap* remove_root(Heap *heap) {
 }
 
 
-/* Insertion of a value in the heap-> Test if new value has smaller distance than the one in the root (longest distance). If yes, root values
+/* Order of the heap: by distance, then by class (as compare_candidates), so that the points kept and the votes do not depend on the
+ * order points are inserted in when distances are tied. */
+static int node_greater(HeapNode* a, HeapNode* b) {
+    if (a->distance != b->distance)
+        return a->distance > b->distance;
+    return a->class > b->class;
+}
+
+
+/* Insertion of a value in the heap-> Test if new value is smaller than the one in the root (longest distance). If yes, root values
  * are updated and sink is called on the root node. if no, that means every value in the heap is already smaller than the new one. */
 void heap_insert(double dist, double class, Heap* heap) {
 
@@ -89,7 +97,7 @@ void heap_insert(double dist, double class, Heap* heap) {
     ins.distance = dist;
     ins.class = class;
 
-    if (heap->nodesArray->distance > ins.distance) {
+    if (node_greater(heap->nodesArray, &ins)) {
         if (heap->nodesArray->distance == INFINITY) ++heap->size;
 
         heap->nodesArray->distance = ins.distance;
@@ -112,8 +120,8 @@ void sink_root(Heap* heap) {
         next = cur * 2;
 
         // Check if current node has larger son
-        add = (root + next + 1)->distance > (root + cur)->distance ? 1 : 0;
-        if (next < heap->capacity - 2 && (root + cur)->distance < (root + next + 2)->distance && (root + next + 1)->distance < (root + next + 2)->distance)
+        add = node_greater(root + next + 1, root + cur) ? 1 : 0;
+        if (next < heap->capacity - 2 && node_greater(root + next + 2, root + cur) && node_greater(root + next + 2, root + next + 1))
             add = 2;
 
         // If found son with higher value: swap them
@@ -177,6 +185,10 @@ most_frequent_class compute_most_frequent_class(Heap *heap) {
 }
 
 
-
-
-
+/* qsort comparison of candidates: by distance, then by class so that the order does not depend on the order points were found */
+int compare_candidates(const void* a, const void* b) {
+    const Candidate *x = (const Candidate*) a, *y = (const Candidate*) b;
+    if (x->distance != y->distance)
+        return (x->distance > y->distance) - (x->distance < y->distance);
+    return (x->class > y->class) - (x->class < y->class);
+}
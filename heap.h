@@ -16,6 +16,13 @@ typedef struct {
     double distance, class;
 } HeapNode;
 
+/* Compact form of a HeapNode sent by slaves to the master (matches MPI_FLOAT_INT). */
+
+typedef struct {
+    float distance;
+    int class;
+} Candidate;
+
 typedef struct {
     unsigned size, capacity;
     HeapNode* nodesArray;
@@ -41,4 +48,6 @@ typedef struct {
 
 most_frequent_class compute_most_frequent_class(Heap *heap);
 
+int compare_candidates(const void* a, const void* b);
+
 #endif /* PROJECT_HEAP_H_ */
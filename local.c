@@ -0,0 +1,426 @@
+/*
+ * local.c
+ */
+
+/*
+ * Single process version of knn, for runs on one machine: no mpirun, no copy of the environment per process and no idle master.
+ * Environment and challengers are read once and shared by a pool of threads, each one scanning the environment for a batch of
+ * challengers at a time with the same kernels as the slaves. Votes and output are the same as the master's.
+ * */
+
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "read.h"
+#include "heap.h"
+#include "csr.h"
+#include "distance.h"
+#include "radius.h"
+#include "options.h"
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+#define ERROR -1
+#define CHUNK_BYTES (1 << 18)  // environment points are scanned in chunks of about this size, kept in cache for a whole batch
+#define LOCAL_BATCH 64         // challengers claimed at once by a thread
+
+
+/* Everything shared by the threads: inputs (read-only once threads are started), results and the queue of challengers */
+typedef struct {
+    float *env_points, *challengers, *env_norms, *chall_norms;
+    CsrMatrix *env_csr, *chall_csr;
+    double *env_sparse_norms, *chall_sparse_norms;
+    int env_size, env_data_size, nb_challengers, chunk_rows, dense_challenger;
+    Metric metric;
+    RadiusQuery query;
+    scan_kernel scan;
+    sparse_scan_kernel sparse_scan;
+    radius_kernel radius_scan;
+    GridHash *grid;
+
+    Heap **closest_dists;     // classification: closest points of each challenger
+    int *counts;              // radius queries: number of points found for each challenger,
+    Candidate **neighbours;   // and the points themselves (unless only counts are wanted)
+
+    pthread_mutex_t lock;
+    int next_chall, failed;
+} LocalRun;
+
+
+/* Claim the next batch of challengers. Returns its size, 0 once every challenger is claimed or a thread failed. */
+static int claim_batch(LocalRun* run, int* first) {
+    int batch = 0;
+
+    pthread_mutex_lock(&run->lock);
+    if (!run->failed && run->next_chall < run->nb_challengers) {
+        *first = run->next_chall;
+        batch = MIN(LOCAL_BATCH, run->nb_challengers - run->next_chall);
+        run->next_chall += batch;
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    return batch;
+}
+
+
+static void fail_run(LocalRun* run) {
+    pthread_mutex_lock(&run->lock);
+    run->failed = 1;
+    pthread_mutex_unlock(&run->lock);
+}
+
+
+/* Compare a batch of challengers to the whole environment, one chunk at a time, and keep the closest points of each challenger
+ * (kernels round distances to single precision as MPI slaves do, so results match the MPI version) */
+static void scan_batch(LocalRun* run, int first, int batch, float* dense_chall) {
+    int dimension = run->env_data_size, chunk_size, first_nz, nnz, chall;
+    CsrMatrix chunk_csr, *chall_csr = run->chall_csr;
+
+    for (int first_row = 0 ; first_row < run->env_size ; first_row += run->chunk_rows) {
+        chunk_size = MIN(run->chunk_rows, run->env_size - first_row);
+
+        if (run->env_csr != NULL) {
+            // View on the rows of the chunk
+            chunk_csr.nb_rows = chunk_size;
+            chunk_csr.nnz = *(run->env_csr->row_ptr + first_row + chunk_size) - *(run->env_csr->row_ptr + first_row);
+            chunk_csr.row_ptr = run->env_csr->row_ptr + first_row;
+            chunk_csr.indices = run->env_csr->indices;
+            chunk_csr.values = run->env_csr->values;
+            chunk_csr.classes = run->env_csr->classes + first_row;
+
+            for (chall = first ; chall < first + batch ; chall++) {
+                first_nz = *(chall_csr->row_ptr + chall);
+                nnz = *(chall_csr->row_ptr + chall + 1) - first_nz;
+
+                // Scatter challenger, scan, then reset the touched coordinates of the dense array
+                for (int c = 0 ; dense_chall != NULL && c < nnz ; c++)
+                    *(dense_chall + *(chall_csr->indices + first_nz + c)) = *(chall_csr->values + first_nz + c);
+
+                run->sparse_scan(&chunk_csr, run->env_sparse_norms + first_row, chall_csr->indices + first_nz,
+                                 chall_csr->values + first_nz, nnz, dense_chall, *(run->chall_sparse_norms + chall), run->metric.p,
+                                 *(run->closest_dists + chall));
+
+                for (int c = 0 ; dense_chall != NULL && c < nnz ; c++)
+                    *(dense_chall + *(chall_csr->indices + first_nz + c)) = 0;
+            }
+        } else {
+            for (chall = first ; chall < first + batch ; chall++) {
+                run->scan(run->env_points + first_row * dimension, chunk_size, run->env_norms != NULL ? run->env_norms + first_row : NULL,
+                          run->challengers + chall * (dimension - 1), run->chall_norms != NULL ? *(run->chall_norms + chall) : 0,
+                          dimension - 1, run->metric.p, *(run->closest_dists + chall));
+            }
+        }
+    }
+}
+
+
+/* Radius queries of a batch of challengers, found is a scratch array of env_size points (NULL if only counts are wanted) */
+static int query_batch(LocalRun* run, int first, int batch, Candidate* found) {
+    int dimension = run->env_data_size, count;
+    float *challenger;
+
+    for (int chall = first ; chall < first + batch ; chall++) {
+        challenger = run->challengers + chall * (dimension - 1);
+        if (run->grid != NULL)
+            count = grid_query(run->grid, run->radius_scan, challenger, run->metric.p, run->query.radius, found);
+        else
+            count = run->radius_scan(run->env_points, run->env_size, run->env_norms, challenger,
+                                     run->chall_norms != NULL ? *(run->chall_norms + chall) : 0, dimension - 1, run->metric.p,
+                                     run->query.radius, found);
+        *(run->counts + chall) = count;
+
+        if (found != NULL) {
+            *(run->neighbours + chall) = (Candidate*) malloc(sizeof(Candidate) * MAX(1, count));
+            if (*(run->neighbours + chall) == NULL) {
+                printf("Error while allocating radius query results\n");
+                return ERROR;
+            }
+            memcpy(*(run->neighbours + chall), found, sizeof(Candidate) * count);
+            qsort(*(run->neighbours + chall), count, sizeof(Candidate), compare_candidates);
+        }
+    }
+
+    return 0;
+}
+
+
+/* Thread of the pool: process batches of challengers until none is left */
+static void* worker(void* arg) {
+    LocalRun *run = (LocalRun*) arg;
+    int first, batch, radius = run->query.radius > 0;
+    float *dense_chall = NULL;
+    Candidate *found = NULL;
+
+    if (run->env_csr != NULL && run->dense_challenger)
+        dense_chall = (float*) calloc(run->env_data_size - 1, sizeof(float));
+    if (radius && !run->query.counts_only)
+        found = (Candidate*) malloc(sizeof(Candidate) * run->env_size);
+
+    if ((run->env_csr != NULL && run->dense_challenger && dense_chall == NULL) || (radius && !run->query.counts_only && found == NULL)) {
+        printf("Error while allocating in worker thread\n");
+        fail_run(run);
+    }
+
+    while ((batch = claim_batch(run, &first)) > 0) {
+        if (radius) {
+            if (query_batch(run, first, batch, found))
+                fail_run(run);
+            continue;
+        }
+
+        scan_batch(run, first, batch, dense_chall);
+    }
+
+    free(dense_chall);
+    free(found);
+    return NULL;
+}
+
+
+/* Read both files (skipping environment points covered by the state file), compute norms and pick the kernels */
+static int load_inputs(LocalRun* run, char environment_file[], char challengers_file[], int skip, int sparse) {
+    run->env_size = count_lines(environment_file) - skip;
+    run->nb_challengers = count_lines(challengers_file);
+    int code, min_env_size = skip > 0 ? 0 : 1;  // nothing appended since the state was saved: challengers are voted again
+
+    if (sparse) {
+        // Sparse points: dimension is the greatest index found in both files, number of points is the one found by the parser
+        int env_max_index = 0, chall_max_index = 0,
+            env_nnz = count_nonzeros(environment_file, 1, skip, &env_max_index, &run->env_size),
+            chall_nnz = count_nonzeros(challengers_file, 0, 0, &chall_max_index, &run->nb_challengers);
+        run->env_data_size = MAX(env_max_index, chall_max_index) + 1;
+
+        if (env_nnz != -1 && chall_nnz != -1 && run->env_size >= min_env_size && run->nb_challengers > 0) {
+            run->env_csr = init_csr(run->env_size, env_nnz, 1);
+            run->chall_csr = init_csr(run->nb_challengers, chall_nnz, 0);
+        }
+
+        code = (run->env_csr == NULL || run->chall_csr == NULL) ? -1 : 0;
+        if (!code) {
+            code = read_sparse_file(run->env_csr, environment_file, 1, skip);
+            code += read_sparse_file(run->chall_csr, challengers_file, 0, 0);
+        }
+
+    } else {
+        run->env_data_size = count_columns(environment_file);
+        if (run->env_size < min_env_size || run->nb_challengers < 1 || run->env_data_size == -1)
+            return ERROR;
+
+        run->env_points = (float*) malloc(run->env_data_size * MAX(1, run->env_size) * sizeof(float));
+        run->challengers = (float*) malloc((run->env_data_size - 1) * run->nb_challengers * sizeof(float));
+
+        code = (run->env_points == NULL || run->challengers == NULL) ? -1 : 0;
+        if (!code) {
+            code = read_file(run->env_points, environment_file, skip, run->env_size, run->env_data_size);
+            code += read_file(run->challengers, challengers_file, 0, run->nb_challengers, run->env_data_size - 1);
+        }
+    }
+    if (code)
+        return ERROR;
+
+
+    // Kernels and norms, as the slaves do
+    int dimension = run->env_data_size;
+    long long env_bytes;
+    run->dense_challenger = dimension - 1 <= SPARSE_DENSE_MAX_DIMENSION;
+    run->scan = select_kernel(run->metric, dimension - 1);
+    run->sparse_scan = select_sparse_kernel(run->metric, run->dense_challenger);
+    run->radius_scan = select_radius_kernel(run->metric);
+
+    if (sparse) {
+        run->env_sparse_norms = (double*) malloc(MAX(1, run->env_size) * sizeof(double));
+        run->chall_sparse_norms = (double*) malloc(run->nb_challengers * sizeof(double));
+        if (run->env_sparse_norms == NULL || run->chall_sparse_norms == NULL)
+            return ERROR;
+        compute_sparse_norms(run->env_sparse_norms, run->env_csr, run->metric);
+        compute_sparse_norms(run->chall_sparse_norms, run->chall_csr, run->metric);
+        env_bytes = (long long) run->env_csr->nnz * (sizeof(int) + sizeof(float)) + (long long) run->env_size * sizeof(float);
+    } else {
+        if (run->metric.type == METRIC_COSINE) {
+            run->env_norms = (float*) malloc(MAX(1, run->env_size) * sizeof(float));
+            run->chall_norms = (float*) malloc(run->nb_challengers * sizeof(float));
+            if (run->env_norms == NULL || run->chall_norms == NULL)
+                return ERROR;
+            compute_norms(run->env_norms, run->env_points + 1, run->env_size, dimension, dimension - 1);
+            compute_norms(run->chall_norms, run->challengers, run->nb_challengers, dimension - 1, dimension - 1);
+        }
+        env_bytes = (long long) run->env_size * dimension * sizeof(float);
+    }
+    run->chunk_rows = MAX(1, (int) MIN((long long) run->env_size, (long long) CHUNK_BYTES * run->env_size / MAX(1, env_bytes)));
+
+    return 0;
+}
+
+
+static void free_inputs(LocalRun* run) {
+    free(run->env_points);
+    free(run->challengers);
+    free(run->env_norms);
+    free(run->chall_norms);
+    delete_csr(run->env_csr);
+    delete_csr(run->chall_csr);
+    free(run->env_sparse_norms);
+    free(run->chall_sparse_norms);
+}
+
+
+static int knn_local(char environment_file[], char challengers_file[], int k, char out_file[], int sparse, Metric metric,
+                     char state_file[], RadiusQuery query, int nb_threads) {
+    LocalRun run;
+    memset(&run, 0, sizeof(LocalRun));
+    run.metric = metric;
+    run.query = query;
+
+
+    // Closest points saved by a previous run (if any): only the environment points appended since then are processed
+    StateHeader saved;
+    FILE *old_state = NULL;
+    saved.env_points = 0;
+    if (state_file != NULL)
+        old_state = read_state_header(state_file, &saved);
+    int skip = old_state != NULL ? saved.env_points : 0;
+
+    int code = load_inputs(&run, environment_file, challengers_file, skip, sparse);
+    int env_total = run.env_size + skip;  // whole environment, including points already processed
+
+
+    // Saved state must come from the same challengers and parameters
+    int state_mismatch = saved.env_points == -1 || (old_state != NULL && (saved.nb_challengers != run.nb_challengers || saved.k != k
+                         || saved.metric != metric.type || saved.p != metric.p
+                         || (!sparse && saved.dimension != run.env_data_size - 1)));
+    if (code || state_mismatch) {
+        if (state_mismatch)
+            printf("State file does not match challengers or parameters\n");
+        else if (old_state != NULL && run.env_size < 0)
+            printf("Environment file has fewer points than when state was saved\n");
+        else if (run.env_size < 1)
+            printf("Environment file is empty\n");
+        else if (run.nb_challengers < 1)
+            printf("Challengers file is empty\n");
+        else
+            printf("An error occurred during initializations\n");
+
+        free_inputs(&run);
+        if (old_state != NULL)
+            fclose(old_state);
+        return ERROR;
+    }
+
+
+    // Results: a heap per challenger, or what radius queries found (grid hash built once, see answer_radius_queries in slave.c)
+    int heaps_ok = 1;
+    if (query.radius > 0) {
+        run.counts = (int*) calloc(run.nb_challengers, sizeof(int));
+        run.neighbours = (Candidate**) calloc(run.nb_challengers, sizeof(Candidate*));
+        if (metric.type != METRIC_COSINE)
+            run.grid = init_grid(run.env_points, run.env_size, run.env_data_size - 1, query.radius);
+    } else {
+        run.closest_dists = (Heap**) calloc(run.nb_challengers, sizeof(Heap*));
+        heaps_ok = run.closest_dists != NULL;
+        for (int i = 0 ; heaps_ok && i < run.nb_challengers ; i++) {
+            *(run.closest_dists + i) = init_heap(MIN(k, env_total));
+            heaps_ok = *(run.closest_dists + i) != NULL;
+        }
+    }
+    pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t) * MAX(1, nb_threads));
+    FILE *out = open_results(out_file);
+
+    // New state is written next to the old one (still being read) and replaces it at the end
+    char *new_state_file = NULL;
+    FILE *new_state = NULL;
+    if (state_file != NULL) {
+        new_state_file = (char*) malloc(strlen(state_file) + 5);
+        if (new_state_file != NULL) {
+            StateHeader header = {env_total, run.nb_challengers, k, run.env_data_size - 1, metric.type, metric.p};
+            sprintf(new_state_file, "%s.tmp", state_file);
+            new_state = write_state_header(new_state_file, &header);
+        }
+    }
+
+    code = !heaps_ok || threads == NULL || out == NULL || (state_file != NULL && new_state == NULL)
+           || (query.radius > 0 && (run.counts == NULL || run.neighbours == NULL));
+
+
+    // Start the pool, threads share the queue of challengers (if some could not be started, the others do their part)
+    int nb_started = 0;
+    if (!code) {
+        pthread_mutex_init(&run.lock, NULL);
+        while (nb_started < nb_threads && !pthread_create(threads + nb_started, NULL, worker, &run))
+            nb_started++;
+
+        worker(&run);  // main thread takes part too
+        for (int i = 0 ; i < nb_started ; i++)
+            pthread_join(*(threads + i), NULL);
+        pthread_mutex_destroy(&run.lock);
+        code = run.failed;
+    }
+
+
+    // Write down in challengers order
+    int failed = code;
+    if (code) {
+        printf("An error occurred during execution\n");
+    } else if (query.radius > 0) {
+        for (int chall = 0 ; chall < run.nb_challengers ; chall++)
+            write_radius_result(out, run.challengers + chall * (run.env_data_size - 1), run.env_data_size - 1, *(run.counts + chall),
+                                *(run.neighbours + chall), query.counts_only);
+    } else {
+        // Same last step as the master: merge points saved by previous run, save the new state, vote and write down
+        for (int chall = 0 ; chall < run.nb_challengers && !failed ; chall++) {
+            failed = vote_and_write(out, *(run.closest_dists + chall), old_state, new_state, run.challengers, run.chall_csr, chall,
+                                    run.env_data_size - 1) != 0;
+            *(run.closest_dists + chall) = NULL;
+        }
+        if (failed)
+            printf("Error occurred while computing highest frequency class\n");
+    }
+
+    if (old_state != NULL)
+        fclose(old_state);
+    if (new_state != NULL) {
+        fclose(new_state);
+        if (failed || rename(new_state_file, state_file)) {
+            printf("State file could not be updated\n");
+            remove(new_state_file);
+        }
+    }
+    free(new_state_file);
+
+
+    // End of run, prepare to exit
+    for (int i = 0 ; run.closest_dists != NULL && i < run.nb_challengers ; i++)
+        delete_heap(*(run.closest_dists + i));
+    for (int i = 0 ; run.neighbours != NULL && i < run.nb_challengers ; i++)
+        free(*(run.neighbours + i));
+    free(run.closest_dists);
+    free(run.counts);
+    free(run.neighbours);
+    delete_grid(run.grid);
+    free_inputs(&run);
+    free(threads);
+    if (out != NULL)
+        fclose(out);
+
+    return failed ? ERROR : 0;
+}
+
+
+int main(int argc, char **argv) {
+    /* Processing parameters (see options.h), same as the MPI version plus the number of threads */
+    Options options;
+    if (parse_options(&options, argc, argv, 1, 1))
+        return 1;
+
+
+    // Main thread is one of the workers
+    if (knn_local(options.environment_file, options.challengers_file, options.k, options.out_file, options.sparse, options.metric,
+                  options.state_file, options.query, options.nb_threads - 1))
+        printf("Run exited abnormally\n");
+    else
+        printf("Run exited normally\n");
+
+    return 0;
+}
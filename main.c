@@ -1,12 +1,11 @@
 #include <mpi.h>
 
 #include <stdio.h>
-#include <errno.h>
-#include <limits.h>
-#include <stdlib.h>
 
 #include "master.h"
 #include "slave.h"
+#include "node.h"
+#include "options.h"
 
 
 int main(int argc, char **argv) {
@@ -18,34 +17,33 @@ int main(int argc, char **argv) {
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
 
 
-    /* Processing parameter k */
-    errno = 0;
-    char *endPtr;
-    int k;
-    long tmp = strtol(argv[3], &endPtr, 10);
-
-    // Verify if conversion went well
-    if (errno != 0 || *endPtr != '\0' || tmp > INT_MAX || tmp < INT_MIN) {
-        printf("Error occurred while processing parameters");
+    /* Processing parameters (see options.h) */
+    Options options;
+    if (parse_options(&options, argc, argv, 0, rank == 0)) {
+        MPI_Finalize();
         return 1;
-    } else {
-        k = tmp;
     }
 
 
     /* Launched node-specific functions */
     if (world_size > 1) {
+        NodeComms comms;
+        init_node_comms(&comms);
+
         if (rank == 0) {
-            if (master(world_size, argv[1], argv[2], k, argv[4]))
+            if (master(world_size, options.environment_file, options.challengers_file, options.k, options.out_file, options.sparse,
+                       options.metric, options.state_file, &comms, options.query))
                 printf("Master exited abnormally\n");
             else
                 printf("Master exited normally\n");
         } else {
-            if (slave(k))
+            if (slave(options.k, options.metric, options.sparse, &comms, options.query))
                 printf("Slave exited abnormally\n");
             else
                 printf("Slave %d exited normally\n", rank);
         }
+
+        free_node_comms(&comms);
     } else {
         printf("Program should be launched with at least two nodes\n");
     }
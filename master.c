@@ -9,18 +9,142 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #include "master.h"
 #include "read.h"
 #include "heap.h"
+#include "csr.h"
+#include "distance.h"
+#include "node.h"
+#include "radius.h"
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 #define ERROR -1
+#define CHUNK_BYTES (1 << 20)  // environment points are sent to slaves in chunks of about this size
 
 
+/* Index of the first environment point of a slave: the first bonus_nodes slaves have bonus_set points, others regular_set. */
+static int shard_first_row(int slave, int regular_set, int bonus_set, int bonus_nodes) {
+    return slave <= bonus_nodes ? bonus_set * (slave - 1) : bonus_set * bonus_nodes + regular_set * (slave - bonus_nodes - 1);
+}
+
+
+/*
+ * Post the sends of the environment points [first_row, first_row + nb_rows[ to a slave, chunk_rows points at a time (for sparse
+ * points, row pointers of the whole shard go first, the slave rebases them). Returns the number of requests used.
+ * */
+static int isend_shard(float* env_points, CsrMatrix* env_csr, int env_data_size, int first_row, int nb_rows, int chunk_rows,
+                       int dest, MPI_Request* requests) {
+    int nb_requests = 0, chunk_size, first_nz, chunk_nnz;
+
+    if (env_csr != NULL)
+        MPI_Isend(env_csr->row_ptr + first_row, nb_rows + 1, MPI_INT, dest, 15, MPI_COMM_WORLD, requests + nb_requests++);
+
+    for (int row = first_row ; row < first_row + nb_rows ; row += chunk_rows) {
+        chunk_size = MIN(chunk_rows, first_row + nb_rows - row);
+
+        if (env_csr != NULL) {
+            first_nz = *(env_csr->row_ptr + row);
+            chunk_nnz = *(env_csr->row_ptr + row + chunk_size) - first_nz;
+            MPI_Isend(env_csr->indices + first_nz, chunk_nnz, MPI_INT, dest, 15, MPI_COMM_WORLD, requests + nb_requests++);
+            MPI_Isend(env_csr->values + first_nz, chunk_nnz, MPI_FLOAT, dest, 15, MPI_COMM_WORLD, requests + nb_requests++);
+            MPI_Isend(env_csr->classes + row, chunk_size, MPI_FLOAT, dest, 15, MPI_COMM_WORLD, requests + nb_requests++);
+        } else {
+            MPI_Isend(env_points + row * env_data_size, chunk_size * env_data_size, MPI_FLOAT, dest, 15, MPI_COMM_WORLD,
+                      requests + nb_requests++);
+        }
+    }
+
+    return nb_requests;
+}
+
+
+/*
+ * Collect the answers of slaves to radius queries, by batches of RADIUS_BATCH challengers (see answer_radius_queries in slave.c),
+ * and write them down: number of environment points within radius, challenger coordinates, then the points found sorted by
+ * distance (class:distance) unless only counts are wanted. Returns 0, or ERROR if a slave or the master failed to allocate.
+ * */
+static int collect_radius_results(FILE* out, float* challengers, int nb_challengers, int dimension, int world_size, RadiusQuery query) {
+    int *counts = (int*) malloc(sizeof(int) * (RADIUS_BATCH + 1) * world_size),
+        *recvcounts = (int*) malloc(sizeof(int) * world_size),
+        *displs = (int*) malloc(sizeof(int) * world_size);
+    Candidate *found = NULL, *grown, *neighbours = NULL;
+    int batch, total, capacity = 0, nb_neighbours, failed = counts == NULL || recvcounts == NULL || displs == NULL;
+
+    // Slaves are blocked in the collective operations otherwise
+    if (failed) {
+        printf("Error while allocating radius query results\n");
+        MPI_Abort(MPI_COMM_WORLD, ERROR);
+    }
+
+    for (int first = 0 ; first < nb_challengers ; first += RADIUS_BATCH) {
+        batch = MIN(RADIUS_BATCH, nb_challengers - first);
+
+        for (int c = 0 ; c <= RADIUS_BATCH ; c++)  // master takes part with no point found
+            *(counts + c) = 0;
+        MPI_Gather(MPI_IN_PLACE, RADIUS_BATCH + 1, MPI_INT, counts, RADIUS_BATCH + 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+        // Points found by each slave for the batch, one after the other
+        total = 0;
+        for (int i = 0 ; i < world_size ; i++) {
+            *(displs + i) = total;
+            *(recvcounts + i) = 0;
+            if (*(counts + i * (RADIUS_BATCH + 1) + RADIUS_BATCH)) {
+                failed = 1;
+                continue;
+            }
+            for (int c = 0 ; !query.counts_only && c < batch ; c++)
+                *(recvcounts + i) += *(counts + i * (RADIUS_BATCH + 1) + c);
+            total += *(recvcounts + i);
+        }
+
+        if (!query.counts_only) {
+            if (capacity < total) {
+                capacity = total;
+                grown = (Candidate*) realloc(found, sizeof(Candidate) * capacity);
+                free(neighbours);
+                neighbours = (Candidate*) malloc(sizeof(Candidate) * capacity);
+                if (grown == NULL || neighbours == NULL) {
+                    printf("Error while allocating radius query results\n");
+                    MPI_Abort(MPI_COMM_WORLD, ERROR);
+                }
+                found = grown;
+            }
+            MPI_Gatherv(MPI_IN_PLACE, 0, MPI_FLOAT_INT, found, recvcounts, displs, MPI_FLOAT_INT, 0, MPI_COMM_WORLD);
+        }
 
-int master(int world_size, char environment_file[], char challengers_file[], int k, char out_file[]) {
+        if (failed)
+            continue;
+
+        // Gather the points found by all slaves for each challenger (they follow each other in slave replies)
+        for (int c = 0 ; c < batch ; c++) {
+            nb_neighbours = 0;
+            for (int i = 1 ; i < world_size ; i++) {
+                for (int j = 0 ; !query.counts_only && j < *(counts + i * (RADIUS_BATCH + 1) + c) ; j++)
+                    *(neighbours + nb_neighbours + j) = *(found + (*(displs + i))++);
+                nb_neighbours += *(counts + i * (RADIUS_BATCH + 1) + c);
+            }
+
+            if (!query.counts_only)
+                qsort(neighbours, nb_neighbours, sizeof(Candidate), compare_candidates);
+            write_radius_result(out, challengers + (first + c) * dimension, dimension, nb_neighbours, neighbours, query.counts_only);
+        }
+    }
+
+    free(counts);
+    free(recvcounts);
+    free(displs);
+    free(found);
+    free(neighbours);
+    return failed ? ERROR : 0;
+}
+
+
+int master(int world_size, char environment_file[], char challengers_file[], int k, char out_file[], int sparse, Metric metric,
+           char state_file[], NodeComms* comms, RadiusQuery query) {
     MPI_Status status;
 
     /* ** Initializations ** */
@@ -28,29 +152,86 @@ int master(int world_size, char environment_file[], char challengers_file[], int
     // Fetch dimension of points, number of environment points and number of challenger points
     int env_size = count_lines(environment_file),
         nb_challengers = count_lines(challengers_file),
-        env_data_size = count_columns(environment_file);  // includes point coordinates AND its class
+        env_data_size,  // includes point coordinates AND its class
+        code;
+
+
+    // Closest points saved by a previous run (if any): only the environment points appended since then are processed
+    StateHeader saved;
+    FILE *old_state = NULL;
+    saved.env_points = 0;
+    if (state_file != NULL)
+        old_state = read_state_header(state_file, &saved);
+
+    int env_total = env_size;  // whole environment, including points already processed
+    if (saved.env_points > 0)
+        env_size -= saved.env_points;
+
+    // No point appended since the state was saved is not an error: slaves get empty shards and challengers are voted again from
+    // the saved closest points
+    int min_env_size = old_state != NULL ? 0 : 1;
+
+    float *env_points_buf = NULL, *chall_points_buf = NULL;
+    CsrMatrix *env_csr = NULL, *chall_csr = NULL;
+
+    if (sparse) {
+        // Sparse points: dimension is the greatest index found in both files, number of points is the one found by the parser
+        int env_max_index = 0, chall_max_index = 0,
+            env_nnz = count_nonzeros(environment_file, 1, old_state != NULL ? saved.env_points : 0, &env_max_index, &env_size),
+            chall_nnz = count_nonzeros(challengers_file, 0, 0, &chall_max_index, &nb_challengers);
+        env_data_size = MAX(env_max_index, chall_max_index) + 1;
+        if (env_nnz != -1)
+            env_total = env_size + (old_state != NULL ? saved.env_points : 0);
+
+        if (env_nnz != -1 && chall_nnz != -1 && env_size >= min_env_size && nb_challengers > 0) {
+            env_csr = init_csr(env_size, env_nnz, 1);
+            chall_csr = init_csr(nb_challengers, chall_nnz, 0);
+        }
+
+        code = (env_csr == NULL || chall_csr == NULL) ? -1 : 0;
+        if (!code) {
+            code = read_sparse_file(env_csr, environment_file, 1, old_state != NULL ? saved.env_points : 0);
+            code += read_sparse_file(chall_csr, challengers_file, 0, 0);
+        }
 
+    } else {
+        env_data_size = count_columns(environment_file);
 
-    // Allocate space for reading environment/challengers points (will be used lower)
-    float *env_points_buf = (float*) malloc(env_data_size * env_size * sizeof(float)),
-          *chall_points_buf = (float*) malloc((env_data_size - 1) * nb_challengers * sizeof(float));
+        // Allocate space for reading environment/challengers points (will be used lower)
+        env_points_buf = (float*) malloc(env_data_size * MAX(1, env_size) * sizeof(float));
+        chall_points_buf = (float*) malloc((env_data_size - 1) * nb_challengers * sizeof(float));
 
 
-    // Check if error occurred
-    int code = (chall_points_buf == NULL || env_points_buf == NULL || env_size < 1 || nb_challengers < 1 || env_data_size == -1) ? -1 : 0;
+        // Check if error occurred
+        code = (chall_points_buf == NULL || env_points_buf == NULL || env_size < min_env_size || nb_challengers < 1
+                || env_data_size == -1) ? -1 : 0;
 
 
-    // Store data from files
-    if (!code) {
-        code = read_file(env_points_buf, environment_file, env_size, env_data_size);
-        code += read_file(chall_points_buf, challengers_file, env_size, env_data_size - 1);
+        // Store data from files
+        if (!code) {
+            code = read_file(env_points_buf, environment_file, old_state != NULL ? saved.env_points : 0, env_size, env_data_size);
+            code += read_file(chall_points_buf, challengers_file, 0, nb_challengers, env_data_size - 1);
+        }
     }
 
 
-    // Notify slaves if operations went well
-    MPI_Bcast(&code, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    // Saved state must come from the same challengers and parameters
+    int state_mismatch = saved.env_points == -1 || (old_state != NULL && (saved.nb_challengers != nb_challengers || saved.k != k
+                         || saved.metric != metric.type || saved.p != metric.p || (!sparse && saved.dimension != env_data_size - 1)));
+    if (state_mismatch)
+        code = -1;
+
+
+    // Notify slaves if operations went well and send them the parameters of the run in a single broadcast: status, points
+    // dimension, number of challengers (and their number of non-zeros for sparse points)
+    int params[4] = {code, env_data_size, nb_challengers, chall_csr != NULL ? chall_csr->nnz : 0};
+    MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
     if (code) {
-        if (!env_size)
+        if (state_mismatch)
+            printf("State file does not match challengers or parameters\n");
+        else if (old_state != NULL && env_size < 0)
+            printf("Environment file has fewer points than when state was saved\n");
+        else if (!env_size)
             printf("Environment file is empty\n");
         else if (!nb_challengers)
             printf("Challengers file is empty\n");
@@ -61,165 +242,198 @@ int master(int world_size, char environment_file[], char challengers_file[], int
             free(chall_points_buf);
         if (env_points_buf != NULL)
             free(env_points_buf);
+        delete_csr(chall_csr);
+        delete_csr(env_csr);
+        if (old_state != NULL)
+            fclose(old_state);
         return ERROR;
     }
 
 
-    // Send points dimension to other nodes
-    MPI_Bcast(&env_data_size, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-
-    // Send number of challengers
-    MPI_Bcast(&nb_challengers, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-
-    // Determine how many environment points each node will receive and send them
+    /*
+     * Determine how many environment points each node will receive. Points are sent in chunks of about CHUNK_BYTES so that slaves
+     * compute on the first ones while the next ones are in flight: send each slave its number of points, of non-zeros (sparse
+     * points) and of points per chunk.
+     * */
     int regular_set = env_size / (world_size - 1), bonus_set = regular_set + 1, bonus_nodes = env_size % (world_size - 1);
+    int *chunk_rows = (int*) malloc(sizeof(int) * world_size);
+    int sizes[3], first_row, nb_requests = 0;
+    long long shard_bytes;
 
-    // nodes that receive one extra point for computation
-    for (int i = 1 ; i <= bonus_nodes ; i++) {
-        MPI_Send(&bonus_set, 1, MPI_INT, i, 15, MPI_COMM_WORLD);
-    }
-    // those who have regular set
-    for (int i = (bonus_nodes + 1) ; i < world_size ; i++) {
-        MPI_Send(&regular_set, 1, MPI_INT, i, 15, MPI_COMM_WORLD);
-    }
-
-
-    // Check if slaves have successfully allocated space
-    int sentinel = 0, check;
     for (int i = 1 ; i < world_size ; i++) {
-        MPI_Recv(&check, 1, MPI_INT, i, 15, MPI_COMM_WORLD, &status);
-        sentinel += check;
-    }
-    int can_continue = !sentinel;
-
-
-    // Notify slaves whether they can continue
-    for (int i = 1 ; i < world_size ; i++)
-        MPI_Send(&can_continue, 1, MPI_INT, i, 15, MPI_COMM_WORLD);
-
-    if (!can_continue) {  // at least 1 slave had trouble allocating
-        free(env_points_buf);
-        free(chall_points_buf);
-        printf("An error occurred during slaves memory allocation\n");
-        return ERROR;
-    }
+        first_row = shard_first_row(i, regular_set, bonus_set, bonus_nodes);
+        sizes[0] = i <= bonus_nodes ? bonus_set : regular_set;
+        sizes[1] = sparse ? *(env_csr->row_ptr + first_row + sizes[0]) - *(env_csr->row_ptr + first_row) : 0;
 
+        if (sparse)
+            shard_bytes = (long long) sizes[1] * (sizeof(int) + sizeof(float)) + (long long) sizes[0] * sizeof(float);
+        else
+            shard_bytes = (long long) sizes[0] * env_data_size * sizeof(float);
+        sizes[2] = MAX(1, (int) MIN((long long) sizes[0], (long long) CHUNK_BYTES * sizes[0] / MAX(1, shard_bytes)));
 
-    // Send challengers to slaves
-    MPI_Bcast(chall_points_buf, nb_challengers * (env_data_size - 1), MPI_FLOAT, 0, MPI_COMM_WORLD);
-
+        if (chunk_rows != NULL)
+            *(chunk_rows + i) = sizes[2];
+        nb_requests += (sizes[0] + sizes[2] - 1) / sizes[2] * (sparse ? 3 : 1) + (sparse ? 1 : 0);
 
-    // Send environment points to slaves
-    // bonus set
-    for (int i = 1 ; i <= bonus_nodes ; i++) {
-        MPI_Send(env_points_buf + bonus_set * env_data_size * (i - 1), bonus_set * env_data_size, MPI_INT, i, 15, MPI_COMM_WORLD);
+        MPI_Send(sizes, 3, MPI_INT, i, 15, MPI_COMM_WORLD);
     }
-    // regular set
-    int shift;
-    for (int i = (bonus_nodes + 1) ; i < world_size ; i++) {
-        shift = bonus_set * env_data_size * bonus_nodes + regular_set * env_data_size * (i - bonus_nodes - 1);
-        MPI_Send(env_points_buf + shift, regular_set * env_data_size, MPI_FLOAT, i, 15, MPI_COMM_WORLD);
+    MPI_Request *requests = (MPI_Request*) malloc(sizeof(MPI_Request) * MAX(1, nb_requests));
+
+
+    // Allocate space for the merge: a heap per challenger still waiting for results (created on first reply, deleted once voted)
+    int max_rec = MIN(k, bonus_set);  // largest reply a slave can send (bonus_set >= regular_set)
+    Heap **pending_heaps = (Heap**) calloc(nb_challengers, sizeof(Heap*));
+    int *nb_replies = (int*) calloc(nb_challengers, sizeof(int)),
+        *next_chall = (int*) calloc(world_size, sizeof(int));  // next challenger each slave will reply for
+    Candidate *slave_res = (Candidate*) malloc(sizeof(Candidate) * MAX(1, max_rec));
+    double *bounds = (double*) malloc(sizeof(double) * 2 * nb_challengers);  // master's part of the slaves bounds reduction
+    FILE *out = open_results(out_file);
+
+    // New state is written next to the old one (still being read) and replaces it at the end
+    char *new_state_file = NULL;
+    FILE *new_state = NULL;
+    if (state_file != NULL) {
+        new_state_file = (char*) malloc(strlen(state_file) + 5);
+        if (new_state_file != NULL) {
+            StateHeader header = {env_total, nb_challengers, k, env_data_size - 1, metric.type, metric.p};
+            sprintf(new_state_file, "%s.tmp", state_file);
+            new_state = write_state_header(new_state_file, &header);
+        }
     }
-    free(env_points_buf);
 
+    code = chunk_rows == NULL || requests == NULL || pending_heaps == NULL || nb_replies == NULL || next_chall == NULL
+           || slave_res == NULL || bounds == NULL || out == NULL || (state_file != NULL && new_state == NULL);
 
-    // Allocate space for computation results
-    double *slaves_computed_res = (double*) malloc(sizeof(double) * 2 * nb_challengers * (MIN(k, regular_set) * (world_size - bonus_nodes - 1) + MIN(k, bonus_set) * bonus_nodes));
-    int *best_classes = (int*) malloc(sizeof(int) * nb_challengers);
 
-    code = slaves_computed_res == NULL || best_classes == NULL;
-    MPI_Bcast(&code, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    if (code) {
-        printf("An error occurred during master memory allocation\n");
-        if (slaves_computed_res != NULL)
-            free(slaves_computed_res);
-        if (best_classes != NULL)
-            free(best_classes);
+    // Single validation of every allocation, master's and slaves' ones
+    int failed_alloc;
+    MPI_Allreduce(&code, &failed_alloc, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (failed_alloc) {
+        printf("An error occurred during memory allocation\n");
+        free(env_points_buf);
         free(chall_points_buf);
+        delete_csr(env_csr);
+        delete_csr(chall_csr);
+        free(chunk_rows);
+        free(requests);
+        free(pending_heaps);
+        free(nb_replies);
+        free(next_chall);
+        free(slave_res);
+        free(bounds);
+        if (out != NULL)
+            fclose(out);
+        if (old_state != NULL)
+            fclose(old_state);
+        if (new_state != NULL) {
+            fclose(new_state);
+            remove(new_state_file);
+        }
+        free(new_state_file);
         return ERROR;
     }
 
 
-    // Check if slaves managed to create their heap
-    int dummy_sendv = 0;
-    MPI_Reduce(&dummy_sendv, &code, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
-    Heap *closest_dists = NULL;
-
-    if (!code) {  // went well, create own heap
-        closest_dists = init_heap(MIN(k, env_size));
-        code = closest_dists == NULL;
+    // Send challengers to slaves (node leaders only, they share their copy with the other slaves of their node)
+    if (sparse) {
+        MPI_Bcast(chall_csr->row_ptr, nb_challengers + 1, MPI_INT, 0, comms->leaders_comm);
+        MPI_Bcast(chall_csr->indices, chall_csr->nnz, MPI_INT, 0, comms->leaders_comm);
+        MPI_Bcast(chall_csr->values, chall_csr->nnz, MPI_FLOAT, 0, comms->leaders_comm);
+    } else {
+        MPI_Bcast(chall_points_buf, nb_challengers * (env_data_size - 1), MPI_FLOAT, 0, comms->leaders_comm);
     }
 
-    // Send confirmation
-    MPI_Bcast(&code, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-    if (code) {  // something failed
-        printf("An error occurred while creating heaps\n");
-
-        if (closest_dists != NULL)
-            delete_heap(closest_dists);
-        free(chall_points_buf);
-        free(slaves_computed_res);
-        free(best_classes);
-        return ERROR;
+    // Send environment points to slaves, all chunks are posted at once
+    nb_requests = 0;
+    for (int i = 1 ; i < world_size ; i++) {
+        nb_requests += isend_shard(env_points_buf, env_csr, env_data_size, shard_first_row(i, regular_set, bonus_set, bonus_nodes),
+                                   i <= bonus_nodes ? bonus_set : regular_set, *(chunk_rows + i), i, requests + nb_requests);
     }
+    MPI_Waitall(nb_requests, requests, MPI_STATUSES_IGNORE);
 
+    free(env_points_buf);
+    delete_csr(env_csr);
+    free(chunk_rows);
+    free(requests);
 
-    // Receive slaves computations
-    int nb_rec;  // how many computed distances each slave will return
-    shift = 0;
-    for (int cur_chal = 0 ; cur_chal < nb_challengers ; cur_chal++) {
-        for (int i = 1 ; i < world_size ; i++) {
-            nb_rec = MIN(k, i > bonus_nodes ? regular_set : bonus_set);
-            MPI_Recv(slaves_computed_res + shift, 2 * nb_rec, MPI_DOUBLE, i, 15, MPI_COMM_WORLD, &status);
-            shift += 2 * nb_rec;
-        }
-    }
 
+    // Radius queries: slaves send every point found, no classification
+    int failed = 0;
+    if (query.radius > 0 && collect_radius_results(out, chall_points_buf, nb_challengers, env_data_size - 1, world_size, query)) {
+        printf("An error occurred while answering radius queries\n");
+        failed = 1;
+    }
 
-    // Complete number of results (dist, class) received per challenger (from all slaves)
-    int tot_rec = MIN(k, regular_set) * (world_size - bonus_nodes - 1) + MIN(k, bonus_set) * bonus_nodes;
 
-    // Computations received, determine k closest classes
-    most_frequent_class best;
-    for (int chall = 0 ; chall < nb_challengers ; chall++) {
-        for (int offset = 0 ; offset < tot_rec ; offset++) {
-            shift = 2 * (chall * tot_rec + offset);
-            heap_insert(*(slaves_computed_res + shift), *(slaves_computed_res + shift + 1), closest_dists);
+    // Slaves agree on an upper bound of the global k-th distance of each challenger and only send points under it
+    for (int i = 0 ; query.radius == 0 && i < 2 * nb_challengers ; i++)
+        *(bounds + i) = INFINITY;
+    if (query.radius == 0)
+        MPI_Allreduce(MPI_IN_PLACE, bounds, 2 * nb_challengers, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+    free(bounds);
+
+
+    /*
+     * Receive slaves computations in whatever order they arrive and merge them right away. Each slave replies for the challengers
+     * in order, so a challenger is complete once every slave replied for it and challengers complete in order: they can be voted
+     * and written down immediately. On a failure, keep receiving (slaves would be blocked otherwise) but stop writing.
+     * */
+    int nb_rec, chall, nb_messages = query.radius > 0 ? 0 : nb_challengers * (world_size - 1);
+    Heap *closest_dists;
+    for (int msg = 0 ; msg < nb_messages ; msg++) {
+        MPI_Recv(slave_res, max_rec, MPI_FLOAT_INT, MPI_ANY_SOURCE, 15, MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, MPI_FLOAT_INT, &nb_rec);
+        chall = (*(next_chall + status.MPI_SOURCE))++;
+
+        if (failed)
+            continue;
+
+        if (*(pending_heaps + chall) == NULL)
+            *(pending_heaps + chall) = init_heap(MIN(k, env_total));
+        closest_dists = *(pending_heaps + chall);
+        if (closest_dists == NULL) {
+            failed = 1;
+            continue;
         }
 
-        // Determine highest frequency class
-        best = compute_most_frequent_class(closest_dists);
-        while (!best.is_unique && closest_dists != NULL) {
-            closest_dists = remove_root(closest_dists);
+        for (int i = 0 ; i < nb_rec ; i++)
+            heap_insert((slave_res + i)->distance, (slave_res + i)->class, closest_dists);
 
-            if (closest_dists != NULL)
-                best = compute_most_frequent_class(closest_dists);
-        }
-        *(best_classes + chall) = best.class;
+        if (++*(nb_replies + chall) < world_size - 1)
+            continue;
 
-        clear_heap(closest_dists);
+        // All replies received: merge points saved by previous run, save the new state, vote and write down
+        *(pending_heaps + chall) = NULL;
+        failed = vote_and_write(out, closest_dists, old_state, new_state, chall_points_buf, chall_csr, chall, env_data_size - 1) != 0;
     }
 
     // From here, no need to notify slave if error occurred (they are already finished), just display message on screen
-    if (closest_dists == NULL) {
+    if (failed && query.radius == 0)
         printf("Error occurred while computing highest frequency class\n");
 
-    } else {  // Ties fixed, write down
-        code = write_results(out_file, chall_points_buf, best_classes, nb_challengers, env_data_size - 1);
-
-        if (code)
-            printf("Error occurred while trying to write results in file\n");
+    if (old_state != NULL)
+        fclose(old_state);
+    if (new_state != NULL) {
+        fclose(new_state);
+        if (failed || rename(new_state_file, state_file)) {
+            printf("State file could not be updated\n");
+            remove(new_state_file);
+        }
     }
+    free(new_state_file);
 
 
     // End of main, prepare to exit
-    delete_heap(closest_dists);
+    for (int i = 0 ; i < nb_challengers ; i++)
+        delete_heap(*(pending_heaps + i));
+    fclose(out);
     free(chall_points_buf);
-    free(slaves_computed_res);
-    free(best_classes);
+    delete_csr(chall_csr);
+    free(pending_heaps);
+    free(nb_replies);
+    free(next_chall);
+    free(slave_res);
 
     return 0;
 }
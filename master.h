@@ -8,6 +8,11 @@
 #ifndef PROJECT_MASTER_H_
 #define PROJECT_MASTER_H_
 
-int master(int world_size, char environment_file[], char challengers_file[], int k, char out_file[]);
+#include "distance.h"
+#include "node.h"
+#include "radius.h"
+
+int master(int world_size, char environment_file[], char challengers_file[], int k, char out_file[], int sparse, Metric metric,
+           char state_file[], NodeComms* comms, RadiusQuery query);
 
 #endif /* PROJECT_MASTER_H_ */
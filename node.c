@@ -0,0 +1,54 @@
+/*
+ * node.c
+ */
+
+#include <mpi.h>
+
+#include <stdlib.h>
+
+#include "node.h"
+
+
+/* Split slaves by node and gather master and one slave per node in leaders_comm. Collective on MPI_COMM_WORLD. */
+void init_node_comms(NodeComms* comms) {
+    int rank;
+    MPI_Comm slaves_comm;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_split(MPI_COMM_WORLD, rank == 0 ? MPI_UNDEFINED : 0, rank, &slaves_comm);
+
+    comms->node_comm = MPI_COMM_NULL;
+    comms->node_rank = 0;
+    if (slaves_comm != MPI_COMM_NULL) {
+        MPI_Comm_split_type(slaves_comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &comms->node_comm);
+        MPI_Comm_rank(comms->node_comm, &comms->node_rank);
+        MPI_Comm_free(&slaves_comm);
+    }
+
+    MPI_Comm_split(MPI_COMM_WORLD, comms->node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &comms->leaders_comm);
+}
+
+
+void free_node_comms(NodeComms* comms) {
+    if (comms->node_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&comms->node_comm);
+    if (comms->leaders_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&comms->leaders_comm);
+}
+
+
+/*
+ * Allocate size bytes shared by all slaves of the node (memory is held by the leader, others only map it).
+ * Collective on node_comm, the window must be released with MPI_Win_free. Returns NULL if failed.
+ * */
+void* alloc_node_shared(NodeComms* comms, MPI_Aint size, MPI_Win* win) {
+    void *base;
+    MPI_Aint shared_size;
+    int disp_unit;
+
+    if (MPI_Win_allocate_shared(comms->node_rank == 0 ? size : 0, 1, MPI_INFO_NULL, comms->node_comm, &base, win) != MPI_SUCCESS)
+        return NULL;
+
+    MPI_Win_shared_query(*win, 0, &shared_size, &disp_unit, &base);
+    return base;
+}
@@ -0,0 +1,25 @@
+/*
+ * node.h
+ */
+
+#ifndef PROJECT_NODE_H_
+#define PROJECT_NODE_H_
+
+#include <mpi.h>
+
+/* Communicators used to share data between ranks of a same node. Slaves of a node share one copy of the challengers, only
+ * the leader of the node (node_rank 0) receives it from the master through leaders_comm. The master is rank 0 of
+ * leaders_comm and has no node_comm. */
+
+typedef struct {
+    MPI_Comm node_comm, leaders_comm;
+    int node_rank;
+} NodeComms;
+
+void init_node_comms(NodeComms* comms);
+
+void free_node_comms(NodeComms* comms);
+
+void* alloc_node_shared(NodeComms* comms, MPI_Aint size, MPI_Win* win);
+
+#endif /* PROJECT_NODE_H_ */
@@ -0,0 +1,110 @@
+/*
+ * options.c
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "options.h"
+#include "distance.h"
+#include "radius.h"
+
+
+/*
+ * Parse the command line. -n (number of threads, one per online core by default) is only accepted if with_threads is set.
+ * Messages are only displayed if verbose is set. Returns 0, or -1 if the command line is not valid.
+ * */
+int parse_options(Options* options, int argc, char** argv, int with_threads, int verbose) {
+    if (argc < 5) {
+        if (verbose)
+            printf("Usage: %s environment_file challengers_file k out_file [-m l2|l1|cosine|chebyshev|minkowski] [-p order] [-s] [-t state_file] [-r radius [-c]]%s\n",
+                   argv[0], with_threads ? " [-n threads]" : "");
+        return -1;
+    }
+
+    options->environment_file = argv[1];
+    options->challengers_file = argv[2];
+    options->out_file = argv[4];
+
+
+    /* Processing parameter k */
+    errno = 0;
+    char *endPtr;
+    long tmp = strtol(argv[3], &endPtr, 10);
+
+    // Verify if conversion went well
+    if (errno != 0 || *endPtr != '\0' || tmp > INT_MAX || tmp < INT_MIN) {
+        if (verbose)
+            printf("Error occurred while processing parameters\n");
+        return -1;
+    }
+    options->k = tmp;
+
+
+    /* Processing optional parameters: distance metric (and order of Minkowski metric), sparse input files, state file
+     * (closest points kept from one run to the next one so that only appended environment points are processed), radius query
+     * mode (every environment point within radius of challengers is written instead of a class, k is then ignored), number
+     * of threads */
+    char *metric_name = "l2", *metric_order = NULL, *radius = NULL, *threads = NULL;
+    options->state_file = NULL;
+    options->sparse = 0;
+    options->nb_threads = 1;
+    options->query.radius = 0;
+    options->query.counts_only = 0;
+    for (int i = 5 ; i < argc ; i++) {
+        if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            metric_name = argv[++i];
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            metric_order = argv[++i];
+        else if (!strcmp(argv[i], "-s"))
+            options->sparse = 1;
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            options->state_file = argv[++i];
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            radius = argv[++i];
+        else if (!strcmp(argv[i], "-c"))
+            options->query.counts_only = 1;
+        else if (with_threads && !strcmp(argv[i], "-n") && i + 1 < argc)
+            threads = argv[++i];
+    }
+
+    if (radius != NULL) {
+        options->query.radius = strtod(radius, &endPtr);
+        if (*endPtr != '\0' || !(options->query.radius > 0) || options->sparse || options->state_file != NULL) {
+            if (verbose)
+                printf("Radius must be a positive number, radius queries are not available with -s and -t\n");
+            return -1;
+        }
+    }
+
+    if (parse_metric(&options->metric, metric_name, metric_order)) {
+        if (verbose)
+            printf("Unknown metric or invalid Minkowski order\n");
+        return -1;
+    }
+
+    if (options->sparse && select_sparse_kernel(options->metric, 0) == NULL) {
+        if (verbose)
+            printf("Chosen metric is not available for sparse points\n");
+        return -1;
+    }
+
+    if (with_threads && threads == NULL) {
+        tmp = sysconf(_SC_NPROCESSORS_ONLN);
+        options->nb_threads = tmp > 0 ? tmp : 1;
+    } else if (with_threads) {
+        tmp = strtol(threads, &endPtr, 10);
+        if (*endPtr != '\0' || tmp < 1 || tmp > 1024) {
+            if (verbose)
+                printf("Number of threads must be between 1 and 1024\n");
+            return -1;
+        }
+        options->nb_threads = tmp;
+    }
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * options.h
+ */
+
+#ifndef PROJECT_OPTIONS_H_
+#define PROJECT_OPTIONS_H_
+
+#include "distance.h"
+#include "radius.h"
+
+/* Command line shared by the MPI and the single process versions:
+ * environment_file challengers_file k out_file [-m metric] [-p order] [-s] [-t state_file] [-r radius [-c]] (and [-n threads]) */
+
+typedef struct {
+    char *environment_file, *challengers_file, *out_file, *state_file;
+    int k, sparse, nb_threads;
+    Metric metric;
+    RadiusQuery query;
+} Options;
+
+int parse_options(Options* options, int argc, char** argv, int with_threads, int verbose);
+
+#endif /* PROJECT_OPTIONS_H_ */
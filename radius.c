@@ -0,0 +1,150 @@
+/*
+ * radius.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "radius.h"
+#include "distance.h"
+#include "heap.h"
+
+
+/* Bucket of a cell (integer coordinates), table_size is a power of 2 */
+static int hash_cell(long long* cell, int dimension, int table_size) {
+    static const unsigned long long primes[GRID_MAX_DIMENSION] = {73856093ULL, 19349663ULL, 83492791ULL, 49979687ULL};
+    unsigned long long h = 0;
+
+    for (int i = 0 ; i < dimension ; i++)
+        h ^= (unsigned long long) *(cell + i) * primes[i];
+
+    return (int) (h & (unsigned long long) (table_size - 1));
+}
+
+
+static void compute_cell(GridHash* grid, float* coords, long long* cell) {
+    for (int i = 0 ; i < grid->dimension ; i++)
+        *(cell + i) = (long long) floor((*(coords + i) - *(grid->origin + i)) / grid->cell_size);
+}
+
+
+/*
+ * Build the grid hash of nb_points points of the given dimension (class not included). Points are copied in bucket order, the
+ * original buffer is left untouched. Returns NULL if an allocation failed or the dimension is too high.
+ * */
+GridHash* init_grid(float* points, int nb_points, int dimension, double cell_size) {
+    if (dimension > GRID_MAX_DIMENSION)
+        return NULL;
+
+    GridHash *grid = malloc(sizeof(GridHash));
+    if (grid == NULL) {
+        printf("Error while allocating in grid initialization\n");
+        return NULL;
+    }
+
+    grid->dimension = dimension;
+    grid->nb_points = nb_points;
+    grid->cell_size = cell_size;
+    grid->table_size = 1;
+    while (grid->table_size < nb_points)
+        grid->table_size <<= 1;
+
+    grid->origin = malloc(sizeof(float) * dimension);
+    grid->points = malloc(sizeof(float) * (dimension + 1) * (nb_points > 0 ? nb_points : 1));
+    grid->bucket_start = calloc(grid->table_size + 1, sizeof(int));
+    int *buckets = malloc(sizeof(int) * (nb_points > 0 ? nb_points : 1));
+
+    if (grid->origin == NULL || grid->points == NULL || grid->bucket_start == NULL || buckets == NULL) {
+        printf("Error while allocating in grid initialization\n");
+        free(buckets);
+        delete_grid(grid);
+        return NULL;
+    }
+
+    // Origin of the grid: smallest coordinates
+    for (int i = 0 ; i < dimension ; i++)
+        *(grid->origin + i) = nb_points > 0 ? *(points + i + 1) : 0;
+    for (int cur = 0 ; cur < nb_points ; cur++) {
+        for (int i = 0 ; i < dimension ; i++) {
+            if (*(points + cur * (dimension + 1) + i + 1) < *(grid->origin + i))
+                *(grid->origin + i) = *(points + cur * (dimension + 1) + i + 1);
+        }
+    }
+
+    // Counting sort of points by bucket
+    long long cell[GRID_MAX_DIMENSION];
+    for (int cur = 0 ; cur < nb_points ; cur++) {
+        compute_cell(grid, points + cur * (dimension + 1) + 1, cell);
+        *(buckets + cur) = hash_cell(cell, dimension, grid->table_size);
+        ++*(grid->bucket_start + *(buckets + cur) + 1);
+    }
+    for (int b = 0 ; b < grid->table_size ; b++)
+        *(grid->bucket_start + b + 1) += *(grid->bucket_start + b);
+
+    // Copy points at the next free position of their bucket
+    int *next = malloc(sizeof(int) * grid->table_size);
+    if (next == NULL) {
+        printf("Error while allocating in grid initialization\n");
+        free(buckets);
+        delete_grid(grid);
+        return NULL;
+    }
+    memcpy(next, grid->bucket_start, sizeof(int) * grid->table_size);
+    for (int cur = 0 ; cur < nb_points ; cur++)
+        memcpy(grid->points + (*(next + *(buckets + cur)))++ * (dimension + 1), points + cur * (dimension + 1),
+               sizeof(float) * (dimension + 1));
+
+    free(next);
+    free(buckets);
+    return grid;
+}
+
+
+void delete_grid(GridHash* grid) {
+    if (grid != NULL) {
+        free(grid->origin);
+        free(grid->points);
+        free(grid->bucket_start);
+        free(grid);
+    }
+}
+
+
+/*
+ * Find points within radius of the challenger by scanning the buckets of its cell and of the 3^dimension - 1 adjacent cells
+ * (each bucket once, different cells may share a bucket). Found points are stored in found if it is not NULL.
+ * Returns the number of points found.
+ * */
+int grid_query(GridHash* grid, radius_kernel kernel, float* challenger, double p, double radius, Candidate* found) {
+    long long center[GRID_MAX_DIMENSION], cell[GRID_MAX_DIMENSION];
+    int offset[GRID_MAX_DIMENSION], visited[81], nb_visited = 0, bucket, seen, nb_found = 0, i;
+
+    compute_cell(grid, challenger, center);
+    for (i = 0 ; i < grid->dimension ; i++)
+        offset[i] = -1;
+
+    do {
+        for (i = 0 ; i < grid->dimension ; i++)
+            cell[i] = center[i] + offset[i];
+        bucket = hash_cell(cell, grid->dimension, grid->table_size);
+
+        seen = 0;
+        for (i = 0 ; i < nb_visited && !seen ; i++)
+            seen = visited[i] == bucket;
+
+        if (!seen) {
+            visited[nb_visited++] = bucket;
+            nb_found += kernel(grid->points + *(grid->bucket_start + bucket) * (grid->dimension + 1),
+                               *(grid->bucket_start + bucket + 1) - *(grid->bucket_start + bucket), NULL, challenger, 0,
+                               grid->dimension, p, radius, found != NULL ? found + nb_found : NULL);
+        }
+
+        // Next offset (counting in base 3 over -1, 0, 1)
+        for (i = 0 ; i < grid->dimension && ++offset[i] > 1 ; i++)
+            offset[i] = -1;
+    } while (i < grid->dimension);
+
+    return nb_found;
+}
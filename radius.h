@@ -0,0 +1,38 @@
+/*
+ * radius.h
+ */
+
+#ifndef PROJECT_RADIUS_H_
+#define PROJECT_RADIUS_H_
+
+#include "distance.h"
+
+#define GRID_MAX_DIMENSION 4  // above, visiting the 3^dimension neighbouring cells costs more than a linear scan
+#define RADIUS_BATCH 256      // challengers whose results are collected by the master at once
+
+/* Fixed-radius query mode: instead of classifying challengers, find every environment point within radius of them (radius 0
+ * means classification mode). Only the number of such points is returned if counts_only is set. */
+
+typedef struct {
+    double radius;
+    int counts_only;
+} RadiusQuery;
+
+/* Uniform grid hash over environment points (stored as "class coord1 coord2 ..."). Cells have the size of the radius, so the
+ * neighbours of a challenger are in its cell or in the adjacent ones. Points are reordered by bucket: points of bucket b are
+ * rows bucket_start[b] to bucket_start[b + 1] - 1 of points. */
+
+typedef struct {
+    int dimension, nb_points, table_size;
+    double cell_size;
+    float *origin, *points;
+    int *bucket_start;
+} GridHash;
+
+GridHash* init_grid(float* points, int nb_points, int dimension, double cell_size);
+
+void delete_grid(GridHash* grid);
+
+int grid_query(GridHash* grid, radius_kernel kernel, float* challenger, double p, double radius, Candidate* found);
+
+#endif /* PROJECT_RADIUS_H_ */
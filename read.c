@@ -9,6 +9,8 @@
 #include <string.h>
 
 #include "read.h"
+#include "csr.h"
+#include "heap.h"
 
 
 /*
@@ -73,13 +75,14 @@ int count_columns(char filename[]) {
 
 /*
  * Read file containing points coordinates (and eventually class) and store numbers in
- * given allocated space (consider every entry as float). Returns -1 if failed to open file.
+ * given allocated space (consider every entry as float). The first skip points are ignored
+ * (already processed in a previous run). Returns -1 if failed to open file.
  *
  * The function takes advantage of the preliminary calculation of the number of elements
  * we should retrieve (nb of challengers * dimension of points for example) that fixes
  * problems linked to presence of white characters at then end of the file.
  * */
-int read_file(float* storage, char filename[], int points, int dimension) {
+int read_file(float* storage, char filename[], int skip, int points, int dimension) {
     FILE *f = fopen(filename, "r");
 
     if (f == NULL) {
@@ -87,6 +90,10 @@ int read_file(float* storage, char filename[], int points, int dimension) {
         return -1;
     }
 
+    float dummy;
+    for (int i = 0 ; i < skip * dimension ; i++)
+        fscanf(f, "%f", &dummy);
+
     int cursor = 0;
     while(cursor < points * dimension) {
         fscanf(f, "%f", storage + cursor);
@@ -98,36 +105,285 @@ int read_file(float* storage, char filename[], int points, int dimension) {
 }
 
 
-/* Writes results of master and slaves computations in file */
-int write_results(char filename[], float* challengers, int* classes, int nb_challengers, int dimension) {
+/* Open results file so that challengers can be written down one by one as soon as they are classified. Returns NULL if failed. */
+FILE* open_results(char filename[]) {
     FILE *f = fopen(filename, "w");
 
+    if (f == NULL)
+        printf("(open results) Error occurred while opening file\n");
+
+    return f;
+}
+
+
+/* Writes class and coordinates of one challenger in an opened results file */
+void write_result(FILE* f, float* challenger, int class, int dimension) {
+    // Write class
+    fprintf(f, "%d", class);
+
+    // Write coordinates of the challenger
+    for (int c = 0 ; c < dimension ; c++)
+        fprintf(f, " %f", *(challenger + c));
+
+    //Line feed to separate next entry (if any)
+    fprintf(f, " \n");
+}
+
+
+/* Writes the result of a fixed-radius query in an opened results file: number of points found and coordinates of the challenger,
+ * followed by the points found ("class:distance") unless only counts are wanted (neighbours is then not used) */
+void write_radius_result(FILE* f, float* challenger, int dimension, int count, Candidate* neighbours, int counts_only) {
+    fprintf(f, "%d", count);
+
+    for (int c = 0 ; c < dimension ; c++)
+        fprintf(f, " %f", *(challenger + c));
+
+    if (!counts_only) {
+        fprintf(f, " |");
+        for (int i = 0 ; i < count ; i++)
+            fprintf(f, " %d:%f", (neighbours + i)->class, (neighbours + i)->distance);
+    }
+
+    fprintf(f, " \n");
+}
+
+
+/*
+ * Go through a sparse file (libsvm format: "class idx:val idx:val ...", 1-based indices, no class for challengers)
+ * and store its content in storage if it is not NULL. Indices of a point must be increasing (sparse-sparse kernels merge
+ * sorted index lists), a file where they are not is rejected. The first skip points are
+ * only used for the greatest index. Also reports the number of non-zeros, the greatest index and the number of points
+ * read after the skipped ones (blank lines are points only in files without class, so it may differ from count_lines).
+ * Returns -1 if the file is not well formed.
+ * */
+static int parse_sparse_file(FILE* f, CsrMatrix* storage, int has_class, int skip, int* nnz, int* max_index, int* nb_rows) {
+    int row = -skip, index, prev_index, ch;
+    float value, class;
+
+    *nnz = 0;
+    *max_index = 0;
+    while (1) {
+        // Skip empty lines when points start with their class, stop at end of file. Without class every line is a point, an empty
+        // one being the origin (challengers must all get a result line).
+        do {
+            ch = fgetc(f);
+        } while ((has_class && ch == '\n') || ch == '\r' || ch == ' ' || ch == '\t');
+        if (ch == EOF)
+            break;
+        ungetc(ch, f);
+
+        // Never write past the storage (file changed since it was counted)
+        if (storage != NULL && row >= storage->nb_rows)
+            return -1;
+
+        if (has_class) {
+            if (fscanf(f, "%f", &class) != 1)
+                return -1;
+            if (storage != NULL && row >= 0)
+                *(storage->classes + row) = class;
+        }
+
+        // Read index:value pairs until the end of the line
+        prev_index = 0;
+        while (1) {
+            do {
+                ch = fgetc(f);
+            } while (ch == ' ' || ch == '\t' || ch == '\r');
+            if (ch == '\n' || ch == EOF)
+                break;
+            ungetc(ch, f);
+
+            if (fscanf(f, "%d:%f", &index, &value) != 2 || index <= prev_index)
+                return -1;
+            prev_index = index;
+
+            if (index > *max_index)
+                *max_index = index;
+            if (row < 0)
+                continue;
+
+            if (storage != NULL) {
+                if (*nnz >= storage->nnz)
+                    return -1;
+                *(storage->indices + *nnz) = index - 1;
+                *(storage->values + *nnz) = value;
+            }
+            ++*nnz;
+        }
+
+        if (storage != NULL && row >= 0)
+            *(storage->row_ptr + row + 1) = *nnz;
+        row++;
+
+        if (ch == EOF)
+            break;
+    }
+
+    *nb_rows = row;
+    return 0;
+}
+
+
+/*
+ * Count non-zeros and points (after the skip first ones) in provided sparse file in order to determine size of buffers and
+ * find the greatest index used (dimension of points). Returns -1 if file opening failed or file is not well formed.
+ * */
+int count_nonzeros(char filename[], int has_class, int skip, int* max_index, int* nb_rows) {
+    FILE *f = fopen(filename, "r");
+    int nnz;
+
     if (f == NULL) {
-        printf("(write results) Error occurred while opening file\n");
+        printf("(count nonzeros) Error occurred while opening file\n");
         return -1;
     }
 
-    for (int chall = 0 ; chall < nb_challengers ; chall++) {
-        // Write class
-        fprintf(f, "%d", *(classes + chall));
+    if (parse_sparse_file(f, NULL, has_class, skip, &nnz, max_index, nb_rows)) {
+        printf("(count nonzeros) Malformed sparse file (indices of a point must be positive and increasing)\n");
+        nnz = -1;
+    }
+
+    fclose(f);
+    return nnz;
+}
+
 
-        // Write coordinates of the challenger
-        for (int c = 0 ; c < dimension ; c++)
-            fprintf(f, " %f", *(challengers + chall * dimension + c));
+/*
+ * Read sparse file in CSR storage (allocated with the counts found by count_nonzeros). Returns -1 if failed or if the file
+ * does not match those counts anymore.
+ * */
+int read_sparse_file(CsrMatrix* storage, char filename[], int has_class, int skip) {
+    FILE *f = fopen(filename, "r");
+    int nnz, max_index, nb_rows, code;
+
+    if (f == NULL) {
+        printf("(read sparse file) Error occurred while opening file\n");
+        return -1;
+    }
 
-        //Line feed to separate next entry (if any)
-        fprintf(f, " \n");
+    code = parse_sparse_file(f, storage, has_class, skip, &nnz, &max_index, &nb_rows);
+    if (!code && (nb_rows != storage->nb_rows || nnz != storage->nnz)) {
+        printf("(read sparse file) File does not match the counts anymore\n");
+        code = -1;
     }
 
     fclose(f);
+    return code;
+}
+
+
+/* Writes class and non-zeros of one sparse challenger in an opened results file */
+void write_sparse_result(FILE* f, CsrMatrix* challengers, int chall, int class) {
+    fprintf(f, "%d", class);
+
+    for (int c = *(challengers->row_ptr + chall) ; c < *(challengers->row_ptr + chall + 1) ; c++)
+        fprintf(f, " %d:%f", *(challengers->indices + c) + 1, *(challengers->values + c));
+
+    fprintf(f, " \n");
+}
+
+
+/*
+ * Open a state file saved by a previous run and read its header. Returns NULL if there is no such file (header->env_points
+ * is then 0) or if it is not well formed (header->env_points is then -1).
+ * */
+FILE* read_state_header(char filename[], StateHeader* header) {
+    FILE *f = fopen(filename, "r");
+
+    header->env_points = 0;
+    if (f == NULL)
+        return NULL;
+
+    if (fscanf(f, "%d %d %d %d %d %lf", &header->env_points, &header->nb_challengers, &header->k, &header->dimension,
+               &header->metric, &header->p) != 6) {
+        printf("(read state) Malformed state file\n");
+        header->env_points = -1;
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+
+/* Create a state file and write its header. Returns NULL if failed. */
+FILE* write_state_header(char filename[], StateHeader* header) {
+    FILE *f = fopen(filename, "w");
+
+    if (f == NULL) {
+        printf("(write state) Error occurred while opening file\n");
+        return NULL;
+    }
+
+    fprintf(f, "%d %d %d %d %d %.17g\n", header->env_points, header->nb_challengers, header->k, header->dimension,
+            header->metric, header->p);
+    return f;
+}
+
+
+/* Read the saved closest points of the next challenger and insert them in heap. They are merged after the points of the new run, the
+ * heap order (distance, then class) keeps the same points as a run over the whole environment would. Returns -1 if failed. */
+int read_state_entry(FILE* f, Heap* heap) {
+    unsigned size;
+    double dist, class;
+
+    if (fscanf(f, "%u", &size) != 1)
+        return -1;
+
+    for (unsigned i = 0 ; i < size ; i++) {
+        if (fscanf(f, "%lf %lf", &dist, &class) != 2)
+            return -1;
+        heap_insert(dist, class, heap);
+    }
+
     return 0;
 }
 
 
+/* Save the closest points of the next challenger. Distances are the single precision ones slaves send to the master, written
+ * without loss so that they are merged again later exactly as if they had just been received. */
+void write_state_entry(FILE* f, Heap* heap) {
+    fprintf(f, "%u", heap->size);
 
+    for (unsigned i = 0 ; i < heap->size ; i++)
+        fprintf(f, " %.17g %d", (heap->nodesArray + i)->distance, (int) (heap->nodesArray + i)->class);
 
+    fprintf(f, "\n");
+}
 
 
+/*
+ * Last step for a challenger once all its closest points are in heap: merge the points saved by a previous run, save the result
+ * for the next run (before ties are fixed), fix ties by dropping the farthest points and write the class down along with the
+ * challenger (chall-th point of chall_csr for sparse points, of challengers otherwise). old_state and new_state may be NULL.
+ * The heap is deleted in any case. Returns -1 if failed.
+ * */
+int vote_and_write(FILE* out, Heap* heap, FILE* old_state, FILE* new_state, float* challengers, CsrMatrix* chall_csr, int chall,
+                   int dimension) {
+    if (old_state != NULL && read_state_entry(old_state, heap)) {
+        delete_heap(heap);
+        return -1;
+    }
+    if (new_state != NULL)
+        write_state_entry(new_state, heap);
 
+    // Determine highest frequency class
+    most_frequent_class best = compute_most_frequent_class(heap);
+    while (!best.is_unique && heap != NULL) {
+        heap = remove_root(heap);
 
+        if (heap != NULL)
+            best = compute_most_frequent_class(heap);
+    }
 
+    if (heap == NULL)
+        return -1;
+
+    // Ties fixed, write down
+    if (chall_csr != NULL)
+        write_sparse_result(out, chall_csr, chall, best.class);
+    else
+        write_result(out, challengers + chall * dimension, best.class, dimension);
+
+    delete_heap(heap);
+    return 0;
+}
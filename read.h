@@ -8,12 +8,46 @@
 #ifndef PROJECT_LIST_H_
 #define PROJECT_LIST_H_
 
+#include <stdio.h>
+
+#include "csr.h"
+#include "heap.h"
+
+/* Header of a state file: what the saved closest points were computed with. env_points is the number of environment points
+ * already compared to the challengers, next runs only process the points appended after them. */
+
+typedef struct {
+    int env_points, nb_challengers, k, dimension, metric;
+    double p;
+} StateHeader;
+
 int count_lines(char filename[]);
 
 int count_columns(char filename[]);
 
-int read_file(float* storage, char filename[], int points, int dimension);
+int read_file(float* storage, char filename[], int skip, int points, int dimension);
+
+FILE* open_results(char filename[]);
+
+void write_result(FILE* f, float* challenger, int class, int dimension);
+
+void write_radius_result(FILE* f, float* challenger, int dimension, int count, Candidate* neighbours, int counts_only);
+
+int count_nonzeros(char filename[], int has_class, int skip, int* max_index, int* nb_rows);
+
+int read_sparse_file(CsrMatrix* storage, char filename[], int has_class, int skip);
+
+void write_sparse_result(FILE* f, CsrMatrix* challengers, int chall, int class);
+
+FILE* read_state_header(char filename[], StateHeader* header);
+
+FILE* write_state_header(char filename[], StateHeader* header);
+
+int read_state_entry(FILE* f, Heap* heap);
+
+void write_state_entry(FILE* f, Heap* heap);
 
-int write_results(char filename[], float* challengers, int* classes, int nb_challengers, int dimension);
+int vote_and_write(FILE* out, Heap* heap, FILE* old_state, FILE* new_state, float* challengers, CsrMatrix* chall_csr, int chall,
+                   int dimension);
 
 #endif /* PROJECT_LIST_H_ */
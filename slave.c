@@ -12,136 +12,373 @@
 #include <math.h>
 
 #include "heap.h"
+#include "distance.h"
+#include "csr.h"
+#include "node.h"
+#include "radius.h"
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 #define MASTER 0
 #define ERROR -1
 
 
 /*
- * Receives pointers to an environment point and a challenger and computes the distance between them
- */
-double distance(float* environment, float* challenger, int dimension) {
-    double dist = 0;
-    for (int i = 0 ; i < dimension ; i++)
-        dist += pow(*(environment + i) - *(challenger + i), 2.0);
-    return sqrt(dist);
-}
+ * Post the receptions of the environment shard, chunk_rows points at a time. For sparse points, row pointers of the whole shard
+ * come first (received right away and rebased), they give the position of the non-zeros of every chunk.
+ * Requests of chunk c start at requests + c * (returned number of requests per chunk).
+ * */
+static int irecv_shard(float* subenv_points, CsrMatrix* subenv_csr, int dimension, int subenv_size, int chunk_rows,
+                       MPI_Request* requests) {
+    MPI_Status status;
+    int nb_requests = 0, chunk_size, first_nz, chunk_nnz;
 
+    if (subenv_csr != NULL) {
+        MPI_Recv(subenv_csr->row_ptr, subenv_size + 1, MPI_INT, MASTER, 15, MPI_COMM_WORLD, &status);
 
-int slave(int k) {
+        first_nz = *subenv_csr->row_ptr;
+        for (int i = 0 ; i <= subenv_size ; i++)
+            *(subenv_csr->row_ptr + i) -= first_nz;
+    }
 
-    MPI_Status status;
-    int dimension, subenv_size, nb_challengers;
+    for (int row = 0 ; row < subenv_size ; row += chunk_rows) {
+        chunk_size = MIN(chunk_rows, subenv_size - row);
+
+        if (subenv_csr != NULL) {
+            first_nz = *(subenv_csr->row_ptr + row);
+            chunk_nnz = *(subenv_csr->row_ptr + row + chunk_size) - first_nz;
+            MPI_Irecv(subenv_csr->indices + first_nz, chunk_nnz, MPI_INT, MASTER, 15, MPI_COMM_WORLD, requests + nb_requests++);
+            MPI_Irecv(subenv_csr->values + first_nz, chunk_nnz, MPI_FLOAT, MASTER, 15, MPI_COMM_WORLD, requests + nb_requests++);
+            MPI_Irecv(subenv_csr->classes + row, chunk_size, MPI_FLOAT, MASTER, 15, MPI_COMM_WORLD, requests + nb_requests++);
+        } else {
+            MPI_Irecv(subenv_points + row * dimension, chunk_size * dimension, MPI_FLOAT, MASTER, 15, MPI_COMM_WORLD,
+                      requests + nb_requests++);
+        }
+    }
 
-    // If master fails allocation: exit the program
-    int warning;
-    MPI_Bcast(&warning, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    if (warning)
-        return ERROR;
+    return subenv_csr != NULL ? 3 : 1;
+}
 
 
-    // Receive dimension of points
-    MPI_Bcast(&dimension, 1, MPI_INT, 0, MPI_COMM_WORLD);
+static int compare_distances(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
 
 
-    // Receive number of challengers
-    MPI_Bcast(&nb_challengers, 1, MPI_INT, 0, MPI_COMM_WORLD);
+/*
+ * Upper bounds of the global k-th distance this slave can give for a challenger, in the form expected by the MPI_MIN reduction:
+ * its local k-th distance, and the opposite of its local ceil(k / nb_slaves)-th distance (the greatest of those over all slaves
+ * bounds k points). Infinity when the slave has not enough points. sorted is a scratch array of heap capacity.
+ * */
+static void local_bounds(Heap* heap, int k, int nb_slaves, double* sorted, double* bounds) {
+    unsigned sample = (k + nb_slaves - 1) / nb_slaves;
+
+    for (unsigned i = 0 ; i < heap->size ; i++)
+        *(sorted + i) = (heap->nodesArray + i)->distance;
+    qsort(sorted, heap->size, sizeof(double), compare_distances);
+
+    *bounds = heap->size >= (unsigned) k ? *(sorted + k - 1) : INFINITY;
+    *(bounds + 1) = heap->size >= sample ? -*(sorted + sample - 1) : -INFINITY;
+}
 
 
-    // Receive number of environment points
-    MPI_Recv(&subenv_size, 1, MPI_INT, MASTER, 15, MPI_COMM_WORLD, &status);
+/*
+ * Agree with other slaves on an upper bound of the global k-th distance of each challenger (the master takes part with infinite
+ * bounds), then send the master the closest points found for each challenger. Points above the bound cannot be in the global
+ * k closest: only the others are sent, as compact records. results, bounds and sorted are scratch arrays.
+ * */
+static void send_closest(Heap** closest_dists, int nb_challengers, int k, Candidate* results, double* bounds, double* sorted) {
+    int world_size;
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    for (int cur_chal = 0 ; cur_chal < nb_challengers ; cur_chal++)
+        local_bounds(*(closest_dists + cur_chal), k, world_size - 1, sorted, bounds + 2 * cur_chal);
+    MPI_Allreduce(MPI_IN_PLACE, bounds, 2 * nb_challengers, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+
+    double bound;
+    int nb_sent;
+    Heap *heap;
+    for (int cur_chal = 0 ; cur_chal < nb_challengers ; cur_chal++) {
+        heap = *(closest_dists + cur_chal);
+        bound = MIN(*(bounds + 2 * cur_chal), -*(bounds + 2 * cur_chal + 1));
+
+        nb_sent = 0;
+        for (unsigned i = 0 ; i < heap->size ; i++) {
+            if ((heap->nodesArray + i)->distance <= bound) {
+                (results + nb_sent)->distance = (heap->nodesArray + i)->distance;
+                (results + nb_sent)->class = (heap->nodesArray + i)->class;
+                nb_sent++;
+            }
+        }
+        MPI_Send(results, nb_sent, MPI_FLOAT_INT, MASTER, 15, MPI_COMM_WORLD);
+    }
+}
 
 
-    // Allocate space for values to receive
-    float *subenv_points = (float*) malloc(dimension * subenv_size * sizeof(float)),
-          *challengers = (float*) malloc((dimension - 1) * nb_challengers * sizeof(float));
-    double *results = (double*) malloc(MIN(k, subenv_size) * 2 * sizeof(double));  // used later
+/*
+ * Fixed-radius queries against the whole shard, challengers by batches of RADIUS_BATCH: the master gathers the number of points
+ * found for each challenger of the batch (followed by an error flag), then the points themselves unless only counts are wanted.
+ * A grid hash is used when the metric is bounded by coordinates differences (not cosine) and the dimension is low enough,
+ * a linear scan otherwise.
+ * */
+static void answer_radius_queries(float* subenv_points, int subenv_size, float* env_norms, float* challengers, float* chall_norms,
+                                  int nb_challengers, int dimension, Metric metric, RadiusQuery query) {
+    radius_kernel kernel = select_radius_kernel(metric);
+    GridHash *grid = metric.type != METRIC_COSINE ? init_grid(subenv_points, subenv_size, dimension - 1, query.radius) : NULL;
+    int counts[RADIUS_BATCH + 1], batch, nb_found, capacity = 0, error = 0;
+    Candidate *found = NULL, *grown, *dest;
+    float *challenger;
+
+    for (int first = 0 ; first < nb_challengers ; first += RADIUS_BATCH) {
+        batch = MIN(RADIUS_BATCH, nb_challengers - first);
+        nb_found = 0;
+
+        for (int c = 0 ; c <= RADIUS_BATCH ; c++)
+            counts[c] = 0;
+
+        for (int c = 0 ; c < batch && !error ; c++) {
+            // A whole shard must fit after the points already found
+            if (!query.counts_only && capacity < nb_found + subenv_size) {
+                capacity = MAX(2 * capacity, nb_found + subenv_size);
+                grown = (Candidate*) realloc(found, capacity * sizeof(Candidate));
+                if (grown == NULL) {
+                    printf("Error while allocating radius query results\n");
+                    error = 1;
+                    break;
+                }
+                found = grown;
+            }
+
+            challenger = challengers + (first + c) * (dimension - 1);
+            dest = query.counts_only ? NULL : found + nb_found;
+            if (grid != NULL)
+                counts[c] = grid_query(grid, kernel, challenger, metric.p, query.radius, dest);
+            else
+                counts[c] = kernel(subenv_points, subenv_size, env_norms, challenger,
+                                   chall_norms != NULL ? *(chall_norms + first + c) : 0, dimension - 1, metric.p, query.radius, dest);
+            nb_found += counts[c];
+        }
 
+        counts[RADIUS_BATCH] = error;
+        MPI_Gather(counts, RADIUS_BATCH + 1, MPI_INT, NULL, 0, MPI_INT, MASTER, MPI_COMM_WORLD);
+        if (!query.counts_only)
+            MPI_Gatherv(found, error ? 0 : nb_found, MPI_FLOAT_INT, NULL, NULL, NULL, MPI_FLOAT_INT, MASTER, MPI_COMM_WORLD);
+    }
 
-    // Indicate to master if allocation went right
-    int feedback = (subenv_points == NULL) || (challengers == NULL);  // sends 1 if trouble
-    MPI_Send(&feedback, 1, MPI_INT, MASTER, 15, MPI_COMM_WORLD);
+    delete_grid(grid);
+    free(found);
+}
 
 
-    // Wait confirmation to continue (indirect confirmation of others)
-    int can_continue;
-    MPI_Recv(&can_continue, 1, MPI_INT, MASTER, 15, MPI_COMM_WORLD, &status);
+int slave(int k, Metric metric, int sparse, NodeComms* comms, RadiusQuery query) {
 
-    if (!can_continue) {
-        if (subenv_points != NULL)
-            free(subenv_points);
-        if (challengers != NULL)
-            free(challengers);
+    MPI_Status status;
 
-        printf("An error occurred during execution\n");
+    // Receive parameters of the run: status of master initializations (exit the program if it failed), dimension of points,
+    // number of challengers (and their number of non-zeros for sparse points)
+    int params[4];
+    MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
+    if (params[0])
         return ERROR;
-    }
 
+    int dimension = params[1], nb_challengers = params[2], chall_nnz = params[3];
 
-    // Receive challengers
-    MPI_Bcast(challengers, nb_challengers * (dimension - 1), MPI_FLOAT, 0, MPI_COMM_WORLD);
 
+    // Pick the distance kernel specialized for the dimension
+    scan_kernel scan = select_kernel(metric, dimension - 1);
+    int dense_challenger = dimension - 1 <= SPARSE_DENSE_MAX_DIMENSION;  // sparse points: scatter challengers if affordable
+    sparse_scan_kernel sparse_scan = select_sparse_kernel(metric, dense_challenger);
 
-    // Receive the environment points
-    MPI_Recv(subenv_points, subenv_size * dimension, MPI_FLOAT, MASTER, 15, MPI_COMM_WORLD, &status);
 
+    // Receive number of environment points, their number of non-zeros (sparse points) and number of points per chunk
+    int sizes[3];
+    MPI_Recv(sizes, 3, MPI_INT, MASTER, 15, MPI_COMM_WORLD, &status);
 
-    // Wait for master confirmation
-    MPI_Bcast(&warning, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    if (warning) {
-        free(subenv_points);
-        free(challengers);
-        return ERROR;
+    int subenv_size = sizes[0], subenv_nnz = sizes[1], chunk_rows = sizes[2],
+        nb_chunks = (subenv_size + chunk_rows - 1) / chunk_rows;
+
+
+    // Allocate space for values to receive. Challengers are read-only: one copy is shared by all slaves of the node
+    float *subenv_points = NULL, *challengers = NULL;
+    CsrMatrix *subenv_csr = NULL, *chall_csr = NULL, chall_view;
+    MPI_Win chall_win;
+    MPI_Aint chall_bytes = sparse ? (nb_challengers + 1 + chall_nnz) * sizeof(int) + chall_nnz * sizeof(float)
+                                  : (dimension - 1) * nb_challengers * sizeof(float);
+    char *chall_block = (char*) alloc_node_shared(comms, chall_bytes, &chall_win);
+
+    if (sparse) {
+        subenv_csr = init_csr(subenv_size, subenv_nnz, 1);
+        if (chall_block != NULL) {  // CSR arrays laid out one after the other in the shared block
+            chall_view.nb_rows = nb_challengers;
+            chall_view.nnz = chall_nnz;
+            chall_view.row_ptr = (int*) chall_block;
+            chall_view.indices = chall_view.row_ptr + nb_challengers + 1;
+            chall_view.values = (float*) (chall_view.indices + chall_nnz);
+            chall_view.classes = NULL;
+            chall_csr = &chall_view;
+        }
+    } else {
+        subenv_points = (float*) malloc(dimension * MAX(1, subenv_size) * sizeof(float));
+        challengers = (float*) chall_block;
     }
+    MPI_Request *requests = (MPI_Request*) malloc(MAX(1, 3 * nb_chunks) * sizeof(MPI_Request));
+    Candidate *results = (Candidate*) malloc(MAX(1, MIN(k, subenv_size)) * sizeof(Candidate));  // used later
+    double *bounds = (double*) malloc(MAX(1, 2 * nb_challengers) * sizeof(double)),
+           *sorted = (double*) malloc(MAX(1, MIN(k, subenv_size)) * sizeof(double));
 
 
-    // Distance computation
-    double dist;
+    // One heap per challenger (not needed for radius queries), kept from one chunk of environment points to the next
     unsigned n_selec = MIN(k, subenv_size);  // In case there would be less environment points than k
-    Heap *closest_dists;
-    closest_dists = init_heap(n_selec);
+    Heap **closest_dists = (Heap**) calloc(nb_challengers, sizeof(Heap*));
+    int heaps_ok = closest_dists != NULL;
+    for (int i = 0 ; heaps_ok && query.radius == 0 && i < nb_challengers ; i++) {
+        *(closest_dists + i) = init_heap(n_selec);
+        heaps_ok = *(closest_dists + i) != NULL;
+    }
 
-    // Test heap creation
-    warning = closest_dists == NULL;
-    MPI_Reduce(&warning, NULL, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
 
-    // Wait for confirmation (other nodes failed ?)
-    MPI_Bcast(&warning, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    // Cosine metric works on precomputed norms of environment points and challengers
+    float *env_norms = NULL, *chall_norms = NULL;
+    if (metric.type == METRIC_COSINE && !sparse) {
+        env_norms = (float*) malloc(MAX(1, subenv_size) * sizeof(float));
+        chall_norms = (float*) malloc(nb_challengers * sizeof(float));
+    }
 
-    if (warning) {
-        printf("Heap initialization in slave failed\n");
+    // Sparse kernels always work on precomputed norms, challengers may be scattered in a dense array
+    double *env_sparse_norms = NULL, *chall_sparse_norms = NULL;
+    float *dense_chall = NULL;
+    if (sparse) {
+        env_sparse_norms = (double*) malloc(MAX(1, subenv_size) * sizeof(double));
+        chall_sparse_norms = (double*) malloc(nb_challengers * sizeof(double));
+        if (dense_challenger)
+            dense_chall = (float*) calloc(dimension - 1, sizeof(float));
+    }
 
-        if (closest_dists != NULL)
-            delete_heap(closest_dists);
+
+    // Single validation of every allocation, master's and slaves' ones
+    int warning = chall_block == NULL || requests == NULL || results == NULL || bounds == NULL || sorted == NULL || !heaps_ok
+                  || (sparse ? subenv_csr == NULL : subenv_points == NULL)
+                  || (metric.type == METRIC_COSINE && !sparse && (env_norms == NULL || chall_norms == NULL))
+                  || (sparse && (env_sparse_norms == NULL || chall_sparse_norms == NULL || (dense_challenger && dense_chall == NULL)));
+    int failed;
+    MPI_Allreduce(&warning, &failed, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+    if (failed) {
+        printf("An error occurred during execution\n");
+
+        for (int i = 0 ; closest_dists != NULL && i < nb_challengers ; i++)
+            delete_heap(*(closest_dists + i));
+        free(closest_dists);
+        free(env_norms);
+        free(chall_norms);
+        free(env_sparse_norms);
+        free(chall_sparse_norms);
+        free(dense_chall);
+        free(requests);
+        free(results);
+        free(bounds);
+        free(sorted);
         free(subenv_points);
-        free(challengers);
+        if (chall_block != NULL)
+            MPI_Win_free(&chall_win);
+        delete_csr(subenv_csr);
         return ERROR;
     }
 
 
-    // Computed distances and keep k closest
-    for (int cur_chal = 0 ; cur_chal < nb_challengers ; cur_chal++) {
-        for (int cur_env = 0 ; cur_env < subenv_size ; cur_env++) {
-            dist = distance(subenv_points + (cur_env * dimension + 1), challengers + cur_chal * (dimension - 1), dimension - 1);
-            heap_insert(dist, *(subenv_points + cur_env * dimension), closest_dists);
+    // Receive challengers: only node leaders take part in the broadcast, others wait until the shared copy is filled
+    if (comms->node_rank == 0) {
+        if (sparse) {
+            MPI_Bcast(chall_csr->row_ptr, nb_challengers + 1, MPI_INT, 0, comms->leaders_comm);
+            MPI_Bcast(chall_csr->indices, chall_nnz, MPI_INT, 0, comms->leaders_comm);
+            MPI_Bcast(chall_csr->values, chall_nnz, MPI_FLOAT, 0, comms->leaders_comm);
+        } else {
+            MPI_Bcast(challengers, nb_challengers * (dimension - 1), MPI_FLOAT, 0, comms->leaders_comm);
         }
-
-        // Finished computation for a challenger, set results in buffer and send to master
-        for (unsigned i = 0 ; i < n_selec ; i++) {
-            *(results + 2 * i) = (closest_dists->nodesArray + i)->distance;
-            *(results + 2 * i + 1) = (closest_dists->nodesArray + i)->class;
+    }
+    MPI_Win_fence(0, chall_win);
+
+    if (chall_norms != NULL)
+        compute_norms(chall_norms, challengers, nb_challengers, dimension - 1, dimension - 1);
+    if (chall_sparse_norms != NULL)
+        compute_sparse_norms(chall_sparse_norms, chall_csr, metric);
+
+
+    // Post the receptions of all chunks of environment points, computation starts as soon as the first one arrived
+    int chunk_requests = irecv_shard(subenv_points, subenv_csr, dimension, subenv_size, chunk_rows, requests);
+
+
+    // Computed distances and keep k closest (kernel specialized for the metric and dimension, chosen once)
+    int first_row, chunk_size, first_nz, nnz;
+    float *chunk_points;
+    CsrMatrix chunk_csr;
+    for (int chunk = 0 ; chunk < nb_chunks ; chunk++) {
+        MPI_Waitall(chunk_requests, requests + chunk * chunk_requests, MPI_STATUSES_IGNORE);
+
+        first_row = chunk * chunk_rows;
+        chunk_size = MIN(chunk_rows, subenv_size - first_row);
+
+        if (sparse) {
+            // View on the rows of the chunk (row pointers are relative to the whole shard)
+            chunk_csr.nb_rows = chunk_size;
+            chunk_csr.nnz = *(subenv_csr->row_ptr + first_row + chunk_size) - *(subenv_csr->row_ptr + first_row);
+            chunk_csr.row_ptr = subenv_csr->row_ptr + first_row;
+            chunk_csr.indices = subenv_csr->indices;
+            chunk_csr.values = subenv_csr->values;
+            chunk_csr.classes = subenv_csr->classes + first_row;
+            compute_sparse_norms(env_sparse_norms + first_row, &chunk_csr, metric);
+
+            for (int cur_chal = 0 ; cur_chal < nb_challengers ; cur_chal++) {
+                first_nz = *(chall_csr->row_ptr + cur_chal);
+                nnz = *(chall_csr->row_ptr + cur_chal + 1) - first_nz;
+
+                // Scatter challenger, scan, then reset the touched coordinates of the dense array
+                for (int c = 0 ; dense_chall != NULL && c < nnz ; c++)
+                    *(dense_chall + *(chall_csr->indices + first_nz + c)) = *(chall_csr->values + first_nz + c);
+
+                sparse_scan(&chunk_csr, env_sparse_norms + first_row, chall_csr->indices + first_nz, chall_csr->values + first_nz,
+                            nnz, dense_chall, *(chall_sparse_norms + cur_chal), metric.p, *(closest_dists + cur_chal));
+
+                for (int c = 0 ; dense_chall != NULL && c < nnz ; c++)
+                    *(dense_chall + *(chall_csr->indices + first_nz + c)) = 0;
+            }
+        } else {
+            chunk_points = subenv_points + first_row * dimension;
+            if (env_norms != NULL)
+                compute_norms(env_norms + first_row, chunk_points + 1, chunk_size, dimension, dimension - 1);
+
+            // Radius queries are answered once the whole shard is there
+            for (int cur_chal = 0 ; query.radius == 0 && cur_chal < nb_challengers ; cur_chal++) {
+                scan(chunk_points, chunk_size, env_norms != NULL ? env_norms + first_row : NULL, challengers + cur_chal * (dimension - 1),
+                     chall_norms != NULL ? *(chall_norms + cur_chal) : 0, dimension - 1, metric.p, *(closest_dists + cur_chal));
+            }
         }
-        MPI_Send(results, 2 * n_selec, MPI_DOUBLE, MASTER, 15, MPI_COMM_WORLD);
-
-        clear_heap(closest_dists);
     }
 
 
+    // Whole shard processed, answer the master
+    if (query.radius > 0)
+        answer_radius_queries(subenv_points, subenv_size, env_norms, challengers, chall_norms, nb_challengers, dimension, metric, query);
+    else
+        send_closest(closest_dists, nb_challengers, k, results, bounds, sorted);
+
+
     // End of slave, prepare to exit
-    delete_heap(closest_dists);
+    for (int i = 0 ; i < nb_challengers ; i++)
+        delete_heap(*(closest_dists + i));
+    free(closest_dists);
+    free(env_norms);
+    free(chall_norms);
+    free(env_sparse_norms);
+    free(chall_sparse_norms);
+    free(dense_chall);
+    free(requests);
+    free(results);
+    free(bounds);
+    free(sorted);
     free(subenv_points);
-    free(challengers);
+    MPI_Win_free(&chall_win);
+    delete_csr(subenv_csr);
 
     return 0;
 }
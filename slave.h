@@ -8,8 +8,10 @@
 #ifndef PROJECT_SLAVE_H_
 #define PROJECT_SLAVE_H_
 
-float distance(float* environment, float* challenger, int dimension);
+#include "distance.h"
+#include "node.h"
+#include "radius.h"
 
-int slave(int k);
+int slave(int k, Metric metric, int sparse, NodeComms* comms, RadiusQuery query);
 
 #endif /* PROJECT_SLAVE_H_ */